@@ -0,0 +1,273 @@
+#ifndef CAPY_ALGORITHM_HH
+#define CAPY_ALGORITHM_HH
+
+#include "array.hh"
+#include "parallel.hh"
+
+#include <memory>
+
+// This header contains parallel element-wise and reduction algorithms
+// over arrays.  The elements are visited in C order, split into chunks
+// of fixed size that are processed with the GIL released, so the
+// function objects must not use the Python API.  Since the chunking
+// does not depend on the number of threads, floating-point reductions
+// give the same result on every run.  All arrays passed to one call
+// must have the same shape and the dtype given as template argument.
+
+namespace Capy
+{
+    // Number of elements per chunk
+    const npy_intp algorithm_chunk_size = 1 << 14;
+
+    // Iterates over the elements of an array with arbitrary strides in
+    // C order, starting at the given linear index.
+    template <typename T>
+    class ArrayCursor
+    {
+    public:
+        ArrayCursor(Array &array, npy_intp start)
+            : nd(array.ndim()),
+              dims(array.dims()),
+              strides(array.strides()),
+              ptr(array.data<char>())
+        {
+            for (int d = nd - 1; d >= 0; --d) {
+                index[d] = start % dims[d];
+                start /= dims[d];
+                ptr += index[d] * strides[d];
+            }
+        }
+        T &operator*() const
+        {
+            return *(T *)ptr;
+        }
+        ArrayCursor &operator++()
+        {
+            for (int d = nd - 1; d >= 0; --d) {
+                ptr += strides[d];
+                if (++index[d] < dims[d])
+                    break;
+                ptr -= strides[d] * dims[d];
+                index[d] = 0;
+            }
+            return *this;
+        }
+    private:
+        int nd;
+        const npy_intp *dims;
+        const npy_intp *strides;
+        char *ptr;
+        npy_intp index[NPY_MAXDIMS];
+    };
+
+    template <typename T>
+    inline void check_elements(const Array &array, bool writeable)
+    {
+        check_dtype<T>(array);
+        if (!PyArray_ISNOTSWAPPED((PyArrayObject *)(PyObject *)array))
+            throw TypeError("array is not in native byte order");
+        if (!(array.flags() & NPY_ARRAY_ALIGNED))
+            throw ValueError("array is not aligned");
+        if (writeable && !(array.flags() & NPY_ARRAY_WRITEABLE))
+            throw ValueError("array is not writeable");
+    }
+
+    inline void check_same_shape(const Array &a, const Array &b)
+    {
+        if (a.ndim() != b.ndim())
+            throw ValueError("arrays must have the same shape");
+        for (int d = 0; d < a.ndim(); ++d)
+            if (a.dims()[d] != b.dims()[d])
+                throw ValueError("arrays must have the same shape");
+    }
+
+    inline bool is_c_contiguous(const Array &array)
+    {
+        return array.flags() & NPY_ARRAY_C_CONTIGUOUS;
+    }
+
+    // Call body(begin, end) for all chunks of [0, n) in parallel.
+    template <typename Body>
+    void parallel_chunks(npy_intp n, Body body)
+    {
+        const npy_intp chunk = algorithm_chunk_size;
+        parallel_for((n + chunk - 1) / chunk, [&](size_t i) {
+            npy_intp begin = i * chunk;
+            body(begin, std::min(begin + chunk, n));
+        });
+    }
+
+    // Call f(T &) for every element.
+    template <typename T, typename F>
+    void for_each(Array a, F f)
+    {
+        check_elements<T>(a, true);
+        bool contiguous = is_c_contiguous(a);
+        T *data = a.data<T>();
+        parallel_chunks(a.size(), [&](npy_intp begin, npy_intp end) {
+            if (contiguous) {
+                for (npy_intp i = begin; i < end; ++i)
+                    f(data[i]);
+                return;
+            }
+            ArrayCursor<T> x(a, begin);
+            for (npy_intp i = begin; i < end; ++i, ++x)
+                f(*x);
+        });
+    }
+
+    // Call f(T1 &, T2 &) for the elements at the same position of two
+    // arrays.
+    template <typename T1, typename T2, typename F>
+    void for_each(Array a1, Array a2, F f)
+    {
+        check_elements<T1>(a1, true);
+        check_elements<T2>(a2, true);
+        check_same_shape(a1, a2);
+        bool contiguous = is_c_contiguous(a1) && is_c_contiguous(a2);
+        T1 *data1 = a1.data<T1>();
+        T2 *data2 = a2.data<T2>();
+        parallel_chunks(a1.size(), [&](npy_intp begin, npy_intp end) {
+            if (contiguous) {
+                for (npy_intp i = begin; i < end; ++i)
+                    f(data1[i], data2[i]);
+                return;
+            }
+            ArrayCursor<T1> x1(a1, begin);
+            ArrayCursor<T2> x2(a2, begin);
+            for (npy_intp i = begin; i < end; ++i, ++x1, ++x2)
+                f(*x1, *x2);
+        });
+    }
+
+    // Set out = f(in) element-wise.
+    template <typename T, typename U, typename F>
+    void transform(Array in, Array out, F f)
+    {
+        check_elements<T>(in, false);
+        check_elements<U>(out, true);
+        check_same_shape(in, out);
+        bool contiguous = is_c_contiguous(in) && is_c_contiguous(out);
+        const T *x = in.data<T>();
+        U *y = out.data<U>();
+        parallel_chunks(in.size(), [&](npy_intp begin, npy_intp end) {
+            if (contiguous) {
+                for (npy_intp i = begin; i < end; ++i)
+                    y[i] = f(x[i]);
+                return;
+            }
+            ArrayCursor<T> xc(in, begin);
+            ArrayCursor<U> yc(out, begin);
+            for (npy_intp i = begin; i < end; ++i, ++xc, ++yc)
+                *yc = f(*xc);
+        });
+    }
+
+    // Set out = f(in1, in2) element-wise.
+    template <typename T1, typename T2, typename U, typename F>
+    void transform(Array in1, Array in2, Array out, F f)
+    {
+        check_elements<T1>(in1, false);
+        check_elements<T2>(in2, false);
+        check_elements<U>(out, true);
+        check_same_shape(in1, out);
+        check_same_shape(in2, out);
+        bool contiguous = is_c_contiguous(in1) && is_c_contiguous(in2) &&
+            is_c_contiguous(out);
+        const T1 *x1 = in1.data<T1>();
+        const T2 *x2 = in2.data<T2>();
+        U *y = out.data<U>();
+        parallel_chunks(out.size(), [&](npy_intp begin, npy_intp end) {
+            if (contiguous) {
+                for (npy_intp i = begin; i < end; ++i)
+                    y[i] = f(x1[i], x2[i]);
+                return;
+            }
+            ArrayCursor<T1> x1c(in1, begin);
+            ArrayCursor<T2> x2c(in2, begin);
+            ArrayCursor<U> yc(out, begin);
+            for (npy_intp i = begin; i < end; ++i, ++x1c, ++x2c, ++yc)
+                *yc = f(*x1c, *x2c);
+        });
+    }
+
+    // Reduce transform(element) with reduce, starting with init.  Each
+    // chunk is reduced separately, and the partial results are combined
+    // in order.
+    template <typename R, typename T, typename Reduce, typename Transform>
+    R transform_reduce(Array a, R init, Reduce reduce, Transform transform)
+    {
+        check_elements<T>(a, false);
+        npy_intp n = a.size();
+        npy_intp nchunks =
+            (n + algorithm_chunk_size - 1) / algorithm_chunk_size;
+        std::unique_ptr<R[]> partial(new R[nchunks]);
+        bool contiguous = is_c_contiguous(a);
+        const T *x = a.data<T>();
+        parallel_chunks(n, [&](npy_intp begin, npy_intp end) {
+            R acc;
+            if (contiguous) {
+                acc = transform(x[begin]);
+                for (npy_intp i = begin + 1; i < end; ++i)
+                    acc = reduce(acc, transform(x[i]));
+            }
+            else {
+                ArrayCursor<T> xc(a, begin);
+                acc = transform(*xc);
+                for (npy_intp i = begin + 1; i < end; ++i)
+                    acc = reduce(acc, transform(*++xc));
+            }
+            partial[begin / algorithm_chunk_size] = acc;
+        });
+        for (npy_intp i = 0; i < nchunks; ++i)
+            init = reduce(init, partial[i]);
+        return init;
+    }
+
+    // Reduce transform(element1, element2) over two arrays.
+    template <typename R, typename T1, typename T2,
+              typename Reduce, typename Transform>
+    R transform_reduce(Array a1, Array a2, R init,
+                       Reduce reduce, Transform transform)
+    {
+        check_elements<T1>(a1, false);
+        check_elements<T2>(a2, false);
+        check_same_shape(a1, a2);
+        npy_intp n = a1.size();
+        npy_intp nchunks =
+            (n + algorithm_chunk_size - 1) / algorithm_chunk_size;
+        std::unique_ptr<R[]> partial(new R[nchunks]);
+        bool contiguous = is_c_contiguous(a1) && is_c_contiguous(a2);
+        const T1 *x1 = a1.data<T1>();
+        const T2 *x2 = a2.data<T2>();
+        parallel_chunks(n, [&](npy_intp begin, npy_intp end) {
+            R acc;
+            if (contiguous) {
+                acc = transform(x1[begin], x2[begin]);
+                for (npy_intp i = begin + 1; i < end; ++i)
+                    acc = reduce(acc, transform(x1[i], x2[i]));
+            }
+            else {
+                ArrayCursor<T1> x1c(a1, begin);
+                ArrayCursor<T2> x2c(a2, begin);
+                acc = transform(*x1c, *x2c);
+                for (npy_intp i = begin + 1; i < end; ++i)
+                    acc = reduce(acc, transform(*++x1c, *++x2c));
+            }
+            partial[begin / algorithm_chunk_size] = acc;
+        });
+        for (npy_intp i = 0; i < nchunks; ++i)
+            init = reduce(init, partial[i]);
+        return init;
+    }
+
+    // Reduce the elements with op, starting with init.
+    template <typename T, typename Op>
+    T reduce(Array a, T init, Op op)
+    {
+        return transform_reduce<T, T>(a, init, op,
+                                      [](const T &x) { return x; });
+    }
+}
+
+#endif
@@ -128,6 +128,24 @@ namespace Capy
     {
         return PyCallable_Check(obj);
     }
+
+    // Releases the global interpreter lock for the lifetime of the
+    // object.  No Python API functions may be called in the meantime.
+    class AllowThreads
+    {
+    public:
+        AllowThreads()
+            : state(PyEval_SaveThread())
+        {}
+        ~AllowThreads()
+        {
+            PyEval_RestoreThread(state);
+        }
+    private:
+        AllowThreads(const AllowThreads &);
+        AllowThreads &operator=(const AllowThreads &);
+        PyThreadState *state;
+    };
 }
 
 #endif
@@ -4,6 +4,10 @@
 #include "capy.hh"
 #include <numpy/arrayobject.h>
 
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
 namespace Capy
 {
     template <typename T>
@@ -80,6 +84,212 @@ namespace Capy
         static const int value = NPY_LONGDOUBLE;
     };
 
+    template <typename T>
+    class Record;
+
+    // Descriptor of the dtype of elements of type T as a new reference.
+    // Class types are described by Record<T>.
+    template <typename T>
+    struct NumpyDescr
+    {
+        static PyArray_Descr *get()
+        {
+            if constexpr (std::is_class<T>::value)
+                return Record<T>::descr();
+            else {
+                PyArray_Descr *descr =
+                    PyArray_DescrFromType(NumpyTypeCode<T>::value);
+                if (!descr)
+                    throw ExceptionInPythonAPI();
+                return descr;
+            }
+        }
+    };
+    // Fixed-size arrays, only as fields of records
+    template <typename T, size_t N>
+    struct NumpyDescr<T[N]>
+    {
+        static PyArray_Descr *get()
+        {
+            Object spec(Py_BuildValue("(N(n))", NumpyDescr<T>::get(),
+                                      Py_ssize_t(N)));
+            PyArray_Descr *descr;
+            if (!PyArray_DescrConverter(spec, &descr))
+                throw ExceptionInPythonAPI();
+            return descr;
+        }
+    };
+
+    // The fields of a struct T, making up a NumPy structured dtype, so
+    // arrays of T can be passed between C++ and Python without copying.
+    // The fields are added once before the dtype is first used, e.g.
+    // while initializing the module:
+    //
+    //     Capy::Record<Particle>()
+    //         .add_field("pos", &Particle::pos)
+    //         .add_field("mass", &Particle::mass);
+    //
+    // Fields may be scalars, records or fixed-size arrays of these.
+    // Members that aren't added are skipped as padding.
+    template <typename T>
+    class Record
+    {
+    public:
+        template <typename F>
+        Record &add_field(const char *name, F T::*field)
+        {
+            // The offset is measured on an actual object, so records must
+            // be default constructible.
+            const T sample = T();
+            size_t offset =
+                (const char *)&(sample.*field) - (const char *)&sample;
+            Field f = {name, offset, NumpyDescr<F>::get};
+            fields().push_back(f);
+            Py_CLEAR(cached_descr());
+            return *this;
+        }
+
+        // The structured dtype as a new reference
+        static PyArray_Descr *descr()
+        {
+            PyArray_Descr *&descr = cached_descr();
+            if (!descr) {
+                if (fields().empty())
+                    throw TypeError("record type has no fields");
+                Object names(PyList_New(0));
+                Object formats(PyList_New(0));
+                Object offsets(PyList_New(0));
+                for (size_t i = 0; i < fields().size(); ++i) {
+                    const Field &f = fields()[i];
+                    check_error(PyList_Append(names, Object(f.name)));
+                    check_error(PyList_Append(
+                                    formats, Object((PyObject *)f.descr())));
+                    check_error(PyList_Append(offsets,
+                                              Object(long(f.offset))));
+                }
+                Object spec(Py_BuildValue(
+                                "{sOsOsOsn}", "names", (PyObject *)names,
+                                "formats", (PyObject *)formats,
+                                "offsets", (PyObject *)offsets,
+                                "itemsize", Py_ssize_t(sizeof(T))));
+                if (!PyArray_DescrConverter(spec, &descr))
+                    throw ExceptionInPythonAPI();
+            }
+            Py_INCREF(descr);
+            return descr;
+        }
+
+    private:
+        struct Field
+        {
+            const char *name;
+            size_t offset;
+            PyArray_Descr *(*descr)();
+        };
+
+        static std::vector<Field> &fields()
+        {
+            static std::vector<Field> *fields = new std::vector<Field>;
+            return *fields;
+        }
+        static PyArray_Descr *&cached_descr()
+        {
+            static PyArray_Descr *descr = 0;
+            return descr;
+        }
+    };
+
+    // Memory owned by an array created by Array::aligned(), freed by the
+    // destructor of the capsule serving as the array's base
+    struct AlignedBlock
+    {
+        void *base;
+        size_t length;
+        bool mapped;
+    };
+
+    // Number and size of the live blocks, reported by
+    // _capy_memory_summary() as "capy.aligned"
+    inline size_t *aligned_stats()
+    {
+        static size_t stats[2] = {0, 0};
+        return stats;
+    }
+    inline void aligned_memory_summary(size_t *blocks, size_t *bytes)
+    {
+        *blocks = aligned_stats()[0];
+        *bytes = aligned_stats()[1];
+    }
+
+    inline void free_aligned_block(PyObject *capsule)
+    {
+        AlignedBlock *block =
+            (AlignedBlock *)PyCapsule_GetPointer(capsule, "capy.aligned");
+        if (!block)
+            return;
+        --aligned_stats()[0];
+        aligned_stats()[1] -= block->length;
+        if (block->mapped)
+            munmap(block->base, block->length);
+        else
+            free(block->base);
+        delete block;
+    }
+
+    // Allocate bytes aligned to alignment and return a capsule owning
+    // them.  Huge pages are requested with madvise(), which the kernel
+    // may ignore.
+    inline Object allocate_aligned(size_t bytes, size_t alignment,
+                                   bool huge_pages, void **data)
+    {
+        if (!alignment || alignment & (alignment - 1) ||
+            alignment % sizeof(void *))
+            throw ValueError("alignment must be a power of two and a "
+                             "multiple of the pointer size");
+        if (!bytes)
+            bytes = 1;
+        AlignedBlock block = {0, 0, huge_pages};
+        if (huge_pages) {
+            const size_t huge_page = 1 << 21;
+            size_t page = sysconf(_SC_PAGESIZE);
+            size_t extra = alignment > page ? alignment : 0;
+            block.length = (bytes + extra + huge_page - 1) & ~(huge_page - 1);
+            block.base = mmap(0, block.length, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (block.base == MAP_FAILED)
+                throw MemoryError("mmap() failed");
+#ifdef MADV_HUGEPAGE
+            madvise(block.base, block.length, MADV_HUGEPAGE);
+#endif
+            uintptr_t address = (uintptr_t)block.base;
+            *data = (void *)((address + alignment - 1) & ~(alignment - 1));
+        }
+        else {
+            if (posix_memalign(&block.base, alignment, bytes))
+                throw MemoryError("posix_memalign() failed");
+            block.length = bytes;
+            *data = block.base;
+        }
+        AlignedBlock *owned = new AlignedBlock(block);
+        PyObject *capsule =
+            PyCapsule_New(owned, "capy.aligned", free_aligned_block);
+        if (!capsule) {
+            block.mapped ? (void)munmap(block.base, block.length)
+                : free(block.base);
+            delete owned;
+            throw ExceptionInPythonAPI();
+        }
+        static bool registered = false;
+        if (!registered) {
+            TypeMemory memory = {"capy.aligned", aligned_memory_summary};
+            memory_types().push_back(memory);
+            registered = true;
+        }
+        ++aligned_stats()[0];
+        aligned_stats()[1] += block.length;
+        return Object(capsule);
+    }
+
     class Array : public Object
     {
     public:
@@ -97,14 +307,39 @@ namespace Capy
         }
         template <typename T>
         Array(T *data, int nd, npy_intp *dims)
-            : Object(PyArray_SimpleNewFromData(
-                         nd, dims, NumpyTypeCode<T>::value, data))
+            : Object(PyArray_NewFromDescr(
+                         &PyArray_Type, NumpyDescr<T>::get(), nd, dims, 0,
+                         data, NPY_ARRAY_CARRAY, 0))
         {}
         template <typename T>
         Array(T *data, npy_intp size)
-            : Object(PyArray_SimpleNewFromData(
-                         1, &size, NumpyTypeCode<T>::value, data))
+            : Array(data, 1, &size)
         {}
+        // New uninitialized array of the given shape whose data is
+        // aligned to alignment bytes, optionally backed by huge pages
+        template <typename T>
+        static Array aligned(int nd, npy_intp *dims, size_t alignment = 64,
+                             bool huge_pages = false)
+        {
+            size_t count = 1;
+            for (int d = 0; d < nd; ++d)
+                count *= dims[d];
+            void *data;
+            Object owner = allocate_aligned(count * sizeof(T), alignment,
+                                            huge_pages, &data);
+            Array array((T *)data, nd, dims);
+            check_error(PyArray_SetBaseObject(
+                            (PyArrayObject *)(PyObject *)array,
+                            owner.new_reference()));
+            return array;
+        }
+        template <typename T>
+        static Array aligned(npy_intp size, size_t alignment = 64,
+                             bool huge_pages = false)
+        {
+            return aligned<T>(1, &size, alignment, huge_pages);
+        }
+
         template <typename T>
         T *data()
         {
@@ -134,7 +369,166 @@ namespace Capy
         {
             return PyArray_ITEMSIZE(self);
         }
+        PyArray_Descr *descr() const
+        {
+            return PyArray_DESCR(self);
+        }
     };
+
+    // Raise a TypeError unless array has the dtype of T.
+    template <typename T>
+    void check_dtype(const Array &array)
+    {
+        Object expected((PyObject *)NumpyDescr<T>::get());
+        if (PyArray_EquivTypes(array.descr(),
+                               (PyArray_Descr *)(PyObject *)expected))
+            return;
+        Object got(PyObject_Str((PyObject *)array.descr()));
+        Object want(PyObject_Str(expected));
+        PyErr_Format(PyExc_TypeError, "expected an array of dtype %s, got %s",
+                     PyString_AsString(want), PyString_AsString(got));
+        throw ExceptionInPythonAPI();
+    }
+
+    // Array of element type T whose data is C-contiguous and aligned to
+    // Align bytes, checked once on construction, so kernels can rely on
+    // the alignment statically.
+    template <typename T, size_t Align = 64>
+    class AlignedArray : public Array
+    {
+        static_assert(Align && !(Align & (Align - 1)),
+                      "alignment must be a power of two");
+        static_assert(Align % alignof(T) == 0,
+                      "alignment must be a multiple of the element alignment");
+    public:
+        static const size_t alignment = Align;
+
+        AlignedArray(const Object &other)
+            : Array(other)
+        {
+            check_dtype<T>(*this);
+            if (!(flags() & NPY_ARRAY_C_CONTIGUOUS))
+                throw ValueError("array is not C-contiguous");
+            if ((uintptr_t)PyArray_DATA(self) % Align)
+                throw ValueError("array data is not sufficiently aligned");
+        }
+        T *data()
+        {
+            return (T *)__builtin_assume_aligned(Array::data<T>(), Align);
+        }
+    };
+
+    // Array of records of type T, whose dtype and layout are checked
+    // once on construction, so its data can be used as a T array
+    template <typename T>
+    class RecordArray : public Array
+    {
+    public:
+        RecordArray(const Object &other)
+            : Array(other)
+        {
+            check_dtype<T>(*this);
+            if (!(flags() & NPY_ARRAY_C_CONTIGUOUS))
+                throw ValueError("array is not C-contiguous");
+            if ((uintptr_t)PyArray_DATA(self) % alignof(T))
+                throw ValueError("array data is not sufficiently aligned");
+        }
+        T *data()
+        {
+            return Array::data<T>();
+        }
+        T &operator[](npy_intp i)
+        {
+            return data()[i];
+        }
+    };
+
+    // Array parameter of element type T with Dims dimensions, checked
+    // once on construction, which also stores its shape, so elements
+    // can be accessed without checks.  If Contiguous is set, the array
+    // must be C-contiguous and can also be indexed as a flat array.
+    template <typename T, int Dims, bool Contiguous = true>
+    class TypedArray : public Array
+    {
+        static_assert(Dims > 0, "arrays must have at least one dimension");
+    public:
+        TypedArray(const Object &other)
+            : Array(other)
+        {
+            check_dtype<T>(*this);
+            if (ndim() != Dims) {
+                PyErr_Format(PyExc_TypeError,
+                             "expected a %d-dimensional array, got %d "
+                             "dimensions", Dims, ndim());
+                throw ExceptionInPythonAPI();
+            }
+            if (Contiguous && !(flags() & NPY_ARRAY_C_CONTIGUOUS))
+                throw TypeError("expected a C-contiguous array");
+            if (!(flags() & NPY_ARRAY_ALIGNED))
+                throw TypeError("expected an aligned array");
+            ptr = (char *)PyArray_DATA(self);
+            for (int d = 0; d < Dims; ++d) {
+                extents[d] = dims()[d];
+                byte_strides[d] = strides()[d];
+            }
+        }
+        npy_intp shape(int d) const
+        {
+            return extents[d];
+        }
+        T *data()
+        {
+            return (T *)ptr;
+        }
+        T &operator[](npy_intp i)
+        {
+            static_assert(Contiguous, "flat indexing needs a contiguous array");
+            return ((T *)ptr)[i];
+        }
+        template <typename... Index>
+        T &operator()(Index... index)
+        {
+            static_assert(sizeof...(Index) == Dims,
+                          "wrong number of indices");
+            npy_intp i[] = {npy_intp(index)...};
+            npy_intp offset = 0;
+            if constexpr (Contiguous) {
+                for (int d = 0; d < Dims; ++d)
+                    offset = offset * extents[d] + i[d];
+                return ((T *)ptr)[offset];
+            }
+            else {
+                for (int d = 0; d < Dims; ++d)
+                    offset += i[d] * byte_strides[d];
+                return *(T *)(ptr + offset);
+            }
+        }
+    private:
+        char *ptr;
+        npy_intp extents[Dims];
+        npy_intp byte_strides[Dims];
+    };
+
+    inline void release_shared_view(PyObject *capsule)
+    {
+        shared_block_release(PyCapsule_GetPointer(capsule, "capy.shared"));
+    }
+
+    // One-dimensional view of the storage of v, which stays valid when v
+    // moves to a new block, see Class::add_array_member()
+    template <typename T>
+    PyObject *vector_view(SharedVector<T> &v)
+    {
+        Array view(v.data(), npy_intp(v.size()));
+        if (!v.data())
+            return view.new_reference();
+        Object block(PyCapsule_New((void *)v.data(), "capy.shared",
+                                   release_shared_view));
+        shared_block_acquire(v.data());
+        check_error(PyArray_SetBaseObject((PyArrayObject *)(PyObject *)view,
+                                          block.new_reference()));
+        return view.new_reference();
+    }
 }
 
 #endif
@@ -0,0 +1,279 @@
+#ifndef CAPY_CALLBACK_HH
+#define CAPY_CALLBACK_HH
+
+#include "evaluator.hh"
+
+#include <optional>
+#include <type_traits>
+
+// This header contains a wrapper for Python callbacks that calls
+// C-level callables directly.  ctypes and CFFI function pointers, Numba
+// cfuncs and scipy.LowLevelCallable objects are recognized when the
+// callback is bound, and their function pointer is called without
+// entering the interpreter, provided that their signature matches.
+// Other callables of floating-point arguments go through Evaluator,
+// everything else is called through the interpreter.
+
+namespace Capy
+{
+    // C and ctypes names of the types allowed in callback signatures
+    template <typename T>
+    struct CType
+    {};
+    template <>
+    struct CType<void>
+    {
+        static const char *name() { return "void"; }
+        static const char *ctypes_name() { return 0; }
+    };
+    template <>
+    struct CType<double>
+    {
+        static const char *name() { return "double"; }
+        static const char *ctypes_name() { return "c_double"; }
+    };
+    template <>
+    struct CType<int>
+    {
+        static const char *name() { return "int"; }
+        static const char *ctypes_name() { return "c_int"; }
+    };
+    template <>
+    struct CType<long>
+    {
+        static const char *name() { return "long"; }
+        static const char *ctypes_name() { return "c_long"; }
+    };
+    template <>
+    struct CType<bool>
+    {
+        static const char *name() { return "_Bool"; }
+        static const char *ctypes_name() { return "c_bool"; }
+    };
+
+    template <typename Signature>
+    class Callback;
+
+    template <typename R, typename... Args>
+    class Callback<R(Args...)>
+    {
+    public:
+        typedef R (*FunctionPointer)(Args...);
+
+        explicit Callback(Object func_)
+            : func(func_), pointer(0)
+        {
+            pointer = (FunctionPointer)function_pointer(func);
+            if (!pointer)
+                try_evaluator(std::integral_constant<bool, all_double>());
+        }
+
+        // Whether calls bypass the interpreter
+        bool native() const
+        {
+            return pointer || (evaluator && evaluator->native());
+        }
+
+        // The raw function pointer, or 0 if func isn't a C-level callable
+        FunctionPointer function() const
+        {
+            return pointer;
+        }
+
+        R operator()(Args... args) const
+        {
+            if (pointer)
+                return pointer(args...);
+            if constexpr (all_double) {
+                if (evaluator) {
+                    double x[] = {args..., 0.0};
+                    return evaluator->call(x);
+                }
+            }
+            if constexpr (std::is_void<R>::value)
+                func(Object(args)...);
+            else
+                return R(func(Object(args)...));
+        }
+
+        // Set y[i] = func(x[i]) for a callback of one argument.  Native
+        // calls run with the GIL released.
+        template <typename T, typename U>
+        void evaluate(const T *x, U *y, size_t n) const
+        {
+            if (!pointer) {
+                if constexpr (all_double) {
+                    if (evaluator) {
+                        evaluator->evaluate(x, y, n);
+                        return;
+                    }
+                }
+                for (size_t i = 0; i < n; ++i)
+                    y[i] = (*this)(x[i]);
+                return;
+            }
+            AllowThreads allow;
+            for (size_t i = 0; i < n; ++i)
+                y[i] = pointer(x[i]);
+        }
+
+        operator Object() const
+        {
+            return func;
+        }
+
+    private:
+        static const bool all_double = std::is_same<R, double>::value &&
+            (std::is_same<Args, double>::value && ...) && sizeof...(Args) <= 4;
+
+        void try_evaluator(std::true_type)
+        {
+            evaluator.emplace(func, int(sizeof...(Args)));
+        }
+        void try_evaluator(std::false_type)
+        {}
+
+        // Return a module only if it has already been imported, so we
+        // don't import ctypes or cffi just to find out that func isn't
+        // one of theirs.
+        static PyObject *imported_module(const char *name)
+        {
+            return PyDict_GetItemString(PyImport_GetModuleDict(), name);
+        }
+
+        // Signature in C syntax, e.g. "double (double, int)"
+        static std::string c_signature()
+        {
+            std::string sig = CType<R>::name();
+            sig += " (";
+            const char *names[] = {CType<Args>::name()..., 0};
+            for (size_t i = 0; i < sizeof...(Args); ++i) {
+                if (i)
+                    sig += ", ";
+                sig += names[i];
+            }
+            return sig + ")";
+        }
+
+        static bool is_ctypes_type(Object ctypes, Object type,
+                                   const char *name)
+        {
+            if (!name)
+                return (PyObject *)type == Py_None;
+            return (PyObject *)type == (PyObject *)getattr(ctypes, name);
+        }
+
+        // Function pointer at the given address, an integer or None
+        static void *address_pointer(Object address)
+        {
+            if ((PyObject *)address == Py_None)
+                throw TypeError("callback is a null function pointer");
+            void *p = PyLong_AsVoidPtr(address);
+            if (PyErr_Occurred()) {
+                PyErr_Clear();
+                throw TypeError("callback has an invalid function address");
+            }
+            if (!p)
+                throw TypeError("callback is a null function pointer");
+            return p;
+        }
+
+        static void *ctypes_pointer(Object f)
+        {
+            PyObject *module = imported_module("ctypes");
+            if (!module)
+                return 0;
+            Object ctypes(module);
+            ctypes.new_reference();
+            if (!isinstance(f, getattr(ctypes, "_CFuncPtr")))
+                return 0;
+            if (!is_ctypes_type(ctypes, getattr(f, "restype"),
+                                CType<R>::ctypes_name()))
+                return 0;
+            Object argtypes = getattr(f, "argtypes");
+            if (!PyTuple_Check(argtypes) ||
+                PyTuple_GET_SIZE((PyObject *)argtypes) != sizeof...(Args))
+                return 0;
+            const char *names[] = {CType<Args>::ctypes_name()..., 0};
+            for (size_t i = 0; i < sizeof...(Args); ++i) {
+                Object type(PyTuple_GET_ITEM((PyObject *)argtypes, i));
+                type.new_reference();
+                if (!is_ctypes_type(ctypes, type, names[i]))
+                    return 0;
+            }
+            Object address = getattr(
+                getattr(ctypes, "cast")(f, getattr(ctypes, "c_void_p")),
+                "value");
+            return address_pointer(address);
+        }
+
+        static void *cffi_pointer(Object f)
+        {
+            PyObject *module = imported_module("_cffi_backend");
+            if (!module)
+                return 0;
+            Object backend(module);
+            backend.new_reference();
+            if (!isinstance(f, getattr(backend, "CData")))
+                return 0;
+            Object ctype = getattr(backend, "typeof")(f);
+            if (std::string_view(getattr(ctype, "kind")) != "function" ||
+                getattr(ctype, "ellipsis"))
+                return 0;
+            if (std::string_view(getattr(getattr(ctype, "result"), "cname")) !=
+                CType<R>::name())
+                return 0;
+            Object args = getattr(ctype, "args");
+            if (len(args) != sizeof...(Args))
+                return 0;
+            const char *names[] = {CType<Args>::name()..., 0};
+            for (size_t i = 0; i < sizeof...(Args); ++i) {
+                Object arg(PySequence_GetItem(args, i));
+                if (std::string_view(getattr(arg, "cname")) != names[i])
+                    return 0;
+            }
+            Object intptr = getattr(backend, "new_primitive_type")("intptr_t");
+            Object address(PyNumber_Long(getattr(backend, "cast")(intptr, f)));
+            return address_pointer(address);
+        }
+
+        // scipy.LowLevelCallable stores a capsule and its signature;
+        // callables with user data have a different signature and are
+        // rejected.
+        static void *capsule_pointer(Object f)
+        {
+            if (!hasattr(f, "function") || !hasattr(f, "signature"))
+                return 0;
+            Object capsule = getattr(f, "function");
+            if (!PyCapsule_CheckExact(capsule))
+                return 0;
+            std::string_view signature(getattr(f, "signature"));
+            if (signature != c_signature() &&
+                !(sizeof...(Args) == 0 &&
+                  signature == std::string(CType<R>::name()) + " (void)"))
+                return 0;
+            return PyCapsule_GetPointer(capsule, PyCapsule_GetName(capsule));
+        }
+
+        static void *function_pointer(Object f)
+        {
+            if (void *p = ctypes_pointer(f))
+                return p;
+            if (void *p = cffi_pointer(f))
+                return p;
+            if (void *p = capsule_pointer(f))
+                return p;
+            // A Numba cfunc wraps its function pointer in a ctypes
+            // function.
+            if (hasattr(f, "ctypes") && hasattr(f, "address"))
+                return ctypes_pointer(getattr(f, "ctypes"));
+            return 0;
+        }
+
+        Object func;
+        FunctionPointer pointer;
+        std::optional<Evaluator> evaluator;
+    };
+}
+
+#endif
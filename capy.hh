@@ -2,12 +2,26 @@
 #define CAPY_CAPY_HH
 
 #include <Python.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <algorithm>
+#include <deque>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "refcount.hh"
+#include "gil.hh"
+#include "memory.hh"
 #include "exceptions.hh"
 #include "types.hh"
 #include "api.hh"
+#include "state.hh"
+#include "convert.hh"
+#include "memo.hh"
 #include "extension.hh"
 #include "class.hh"
 
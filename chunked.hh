@@ -0,0 +1,160 @@
+#ifndef CAPY_CHUNKED_HH
+#define CAPY_CHUNKED_HH
+
+#include "array.hh"
+
+#include <algorithm>
+#include <functional>
+
+// This header contains Python iterators yielding the output of a C++
+// producer as one-dimensional NumPy arrays of a fixed size.  The
+// iterator alternates between two buffers, reusing one as soon as the
+// consumer has dropped the chunk in it.  In a loop like "for chunk in
+// it: total += chunk.sum()", the loop variable still refers to the
+// previous chunk while the next one is produced, so all chunks are
+// filled into the same two buffers.  Chunks that are kept alive are
+// left alone.
+
+namespace Capy
+{
+    template <typename T>
+    class ChunkIterator
+    {
+    public:
+        // Fills the buffer with up to the given number of elements and
+        // returns the number of elements written, 0 at the end.
+        typedef std::function<size_t (T *, size_t)> Producer;
+
+        // owner is kept alive as long as the iterator.
+        static Object create(const Producer &producer, npy_intp chunk_size,
+                             Object owner)
+        {
+            if (chunk_size <= 0)
+                throw ValueError("chunk size must be positive");
+            PyTypeObject *type = iterator_type();
+            IterObject *self = PyObject_New(IterObject, type);
+            check_error((PyObject *)self);
+            self->producer = 0;
+            self->chunk_size = chunk_size;
+            self->buffers[0] = self->buffers[1] = 0;
+            self->current = 0;
+            self->owner = owner.new_reference();
+            Object result((PyObject *)self);
+            self->producer = new Producer(producer);
+            return result;
+        }
+
+    private:
+        struct IterObject
+        {
+            PyObject_HEAD
+            Producer *producer;
+            npy_intp chunk_size;
+            PyObject *buffers[2];
+            // Index of the buffer returned last
+            int current;
+            PyObject *owner;
+        };
+
+        static PyTypeObject *iterator_type()
+        {
+            static PyTypeObject type;
+            if (!type.tp_name) {
+                type.tp_name = "capy.ChunkIterator";
+                type.tp_basicsize = sizeof(IterObject);
+                type.tp_dealloc = (destructor)dealloc;
+                type.tp_flags = Py_TPFLAGS_DEFAULT;
+                type.tp_doc = "Iterator over chunks of data produced in C++";
+                type.tp_iter = PyObject_SelfIter;
+                type.tp_iternext = (iternextfunc)next;
+                if (PyType_Ready(&type) == -1) {
+                    type.tp_name = 0;
+                    throw ExceptionInPythonAPI();
+                }
+            }
+            return &type;
+        }
+
+        static PyObject *next(IterObject *self)
+        {
+            try {
+                if (!self->producer)
+                    return 0;
+                // Prefer the buffer not returned last, and replace it by
+                // a new one if both are still in use.
+                int i = 1 - self->current;
+                if (self->buffers[i] && Py_REFCNT(self->buffers[i]) > 1 &&
+                    self->buffers[1 - i] && Py_REFCNT(self->buffers[1 - i]) == 1)
+                    i = 1 - i;
+                PyObject *&buffer = self->buffers[i];
+                if (!buffer || Py_REFCNT(buffer) > 1) {
+                    Py_CLEAR(buffer);
+                    buffer = Array(PyArray_NewFromDescr(
+                                       &PyArray_Type, NumpyDescr<T>::get(),
+                                       1, &self->chunk_size, 0, 0, 0, 0))
+                        .new_reference();
+                }
+                self->current = i;
+                Array chunk(Object(buffer).new_reference());
+                npy_intp n = (*self->producer)(chunk.data<T>(),
+                                               self->chunk_size);
+                if (n >= self->chunk_size)
+                    return chunk.new_reference();
+                // The producer is exhausted; return the filled part.
+                delete self->producer;
+                self->producer = 0;
+                if (!n)
+                    return 0;
+                Array part(chunk.data<T>(), n);
+                check_error(PyArray_SetBaseObject(
+                                (PyArrayObject *)(PyObject *)part,
+                                chunk.new_reference()));
+                return part.new_reference();
+            }
+            catch (...) {
+                translate_exception();
+                return 0;
+            }
+        }
+
+        static void dealloc(IterObject *self)
+        {
+            delete self->producer;
+            Py_XDECREF(self->buffers[0]);
+            Py_XDECREF(self->buffers[1]);
+            Py_XDECREF(self->owner);
+            PyObject_Del(self);
+        }
+    };
+
+    // Iterator over chunks of the output of producer, see
+    // ChunkIterator::Producer.
+    template <typename T>
+    Object chunked(const typename ChunkIterator<T>::Producer &producer,
+                   npy_intp chunk_size, Object owner = Object(Py_None).new_reference())
+    {
+        return ChunkIterator<T>::create(producer, chunk_size, owner);
+    }
+
+    // Iterator over chunks of the elements of v.  The vector is indexed
+    // on every step, so it may grow in the meantime, but it must outlive
+    // the iterator, e.g. by being a member of owner.
+    template <typename T, typename A>
+    Object chunked(const std::vector<T, A> &v, npy_intp chunk_size,
+                   Object owner = Object(Py_None).new_reference())
+    {
+        size_t pos = 0;
+        const std::vector<T, A> *vec = &v;
+        return ChunkIterator<T>::create(
+            [vec, pos](T *out, size_t n) mutable {
+                // The vector may have shrunk since the last chunk
+                pos = std::min(pos, vec->size());
+                n = std::min(n, vec->size() - pos);
+                std::copy(vec->begin() + pos, vec->begin() + pos + n, out);
+                pos += n;
+                return n;
+            }, chunk_size, owner);
+    }
+}
+
+#endif
@@ -3,6 +3,169 @@
 
 namespace Capy
 {
+    // Wrapper for members exposed with Class::add_member() that keeps
+    // the Python object returned by the getter.  The object is only
+    // recreated after the value changed: assignments of an unequal
+    // value mark it dirty automatically, modifications through
+    // modify() or in-place changes followed by mark_dirty() need to do
+    // so explicitly.  Marking dirty doesn't touch the Python object, so
+    // it may be done without the GIL, but not while another thread reads
+    // the value.
+    template <typename T>
+    class Cached
+    {
+    public:
+        Cached(const T &value_ = T())
+            : value(value_), cache(0), dirty(true)
+        {}
+        Cached(const Cached &other)
+            : value(other.value), cache(0), dirty(true)
+        {}
+        ~Cached()
+        {
+            if (cache)
+                decref(cache);
+        }
+        Cached &operator=(const T &other)
+        {
+            if (!(value == other)) {
+                value = other;
+                dirty = true;
+            }
+            return *this;
+        }
+        Cached &operator=(const Cached &other)
+        {
+            return *this = other.value;
+        }
+        operator const T &() const
+        {
+            return value;
+        }
+        const T &get() const
+        {
+            return value;
+        }
+        T &modify()
+        {
+            dirty = true;
+            return value;
+        }
+        void mark_dirty()
+        {
+            dirty = true;
+        }
+        // New reference to the cached Python object
+        PyObject *object()
+        {
+            if (dirty.exchange(false) || !cache) {
+                PyObject *obj;
+                try {
+                    obj = Object(value).new_reference();
+                }
+                catch (...) {
+                    dirty = true;
+                    throw;
+                }
+                Py_XDECREF(cache);
+                cache = obj;
+            }
+            Py_INCREF(cache);
+            return cache;
+        }
+    private:
+        T value;
+        PyObject *cache;
+        std::atomic<bool> dirty;
+    };
+
+    // Struct module format of the result types stored in arrays by
+    // batched calls
+    template <typename T>
+    struct BatchFormat
+    {
+        static constexpr const char *value = 0;
+    };
+    template <>
+    struct BatchFormat<double>
+    {
+        static constexpr const char *value = "d";
+    };
+    template <>
+    struct BatchFormat<long>
+    {
+        static constexpr const char *value = "l";
+    };
+    template <>
+    struct BatchFormat<int>
+    {
+        static constexpr const char *value = "i";
+    };
+    template <>
+    struct BatchFormat<bool>
+    {
+        static constexpr const char *value = "?";
+    };
+
+    // Results of a batched method call.  NumPy is only used if it has
+    // already been imported.
+    template <typename RT>
+    class BatchResults
+    {
+    public:
+        explicit BatchResults(Py_ssize_t n)
+            : result(Object(Py_None).new_reference()), data(0)
+        {
+            PyObject *numpy = BatchFormat<RT>::value ?
+                PyDict_GetItemString(PyImport_GetModuleDict(), "numpy") : 0;
+            if (!numpy) {
+                result = Object(PyList_New(n));
+                return;
+            }
+            result = Object(PyObject_CallMethod(
+                                numpy, (char *)"empty", (char *)"ns", n,
+                                BatchFormat<RT>::value));
+            void *buffer;
+            Py_ssize_t size;
+            check_error(PyObject_AsWriteBuffer(result, &buffer, &size));
+            data = buffer;
+        }
+        void set(Py_ssize_t i, RT value)
+        {
+            if constexpr (BatchFormat<RT>::value != 0) {
+                if (data) {
+                    ((RT *)data)[i] = value;
+                    return;
+                }
+            }
+            PyList_SET_ITEM((PyObject *)result, i,
+                            ReturnConverter<RT>::convert(value));
+        }
+        PyObject *release()
+        {
+            return result.new_reference();
+        }
+    private:
+        Object result;
+        void *data;
+    };
+    template <>
+    class BatchResults<void>
+    {
+    public:
+        explicit BatchResults(Py_ssize_t)
+        {}
+        PyObject *release()
+        {
+            Py_RETURN_NONE;
+        }
+    };
+
+    // Defined in array.hh, which must be included to use
+    // Class::add_array_member()
+    template <typename T>
+    PyObject *vector_view(SharedVector<T> &v);
+
     template <typename Cls>
     class Class
     {
@@ -10,27 +173,52 @@ namespace Capy
         Extension &extension;
         const char *const type_name;
 
+        // Array views handed out for a member, see add_array_member()
+        struct View
+        {
+            PyObject *ref;
+            const void *data;
+            size_t size;
+        };
+        typedef std::unordered_map<const void *, View> Views;
+
         struct ClsObject
         {
             PyObject_HEAD
             Cls *instance;
+            Views *views;
+            bool owned;
         };
 
+        // A qualified type name like "module.Type" is used as is,
+        // otherwise the module name is prepended at runtime.
         Class(Extension &ext, const char *type_name_, const char *doc = 0)
             : extension(ext),
-              type_name(type_name_),
+              type_name(base_name(type_name_)),
               type(new PyTypeObject),
               methods(new std::vector<PyMethodDef>),
-              members(new std::vector<int Cls::*>),
-              py_members(new std::vector<Object Cls::*>),
+              static_methods(0),
+              members(new std::deque<int Cls::*>),
+              py_members(new std::deque<Object Cls::*>),
               getset(new std::vector<PyGetSetDef>)
         {
+            static_assert(IsWrapped<Cls>::value,
+                          "wrapped classes must be declared with CAPY_WRAPPED");
             memset(type, 0, sizeof(*type));
             Py_INCREF(type);
-            char *qname =
-                new char[strlen(extension.mod_name) + strlen(type_name) + 2];
-            sprintf(qname, "%s.%s", extension.mod_name, type_name);
-            type->tp_name = qname;
+            // The type is registered only once; ~Class() doesn't add it
+            // to the module when an error is set.
+            if (registered_type)
+                PyErr_Format(PyExc_RuntimeError,
+                             "class %s has already been wrapped",
+                             registered_type->tp_name);
+            else
+                registered_type = type;
+            if (type_name != type_name_)
+                type->tp_name = type_name_;
+            else
+                type->tp_name = extension.keep_name(
+                    std::string(extension.mod_name) + "." + type_name);
             type->tp_basicsize = sizeof(ClsObject);
             type->tp_dealloc = (destructor)dealloc;
             type->tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE |
@@ -39,18 +227,35 @@ namespace Capy
             type->tp_traverse = (traverseproc)traverse;
             type->tp_base = 0; // XXX
             type->tp_new = new_;
-            PyMethodDef meth = {0};
-            methods->push_back(meth);
-            PyGetSetDef gs = {0};
-            getset->push_back(gs);
+            TypeMemory memory = {type->tp_name, memory_summary};
+            memory_types().push_back(memory);
         }
 
         ~Class()
         {
             if (PyErr_Occurred())
                 return;
-            type->tp_methods = &methods->front();
+            if (static_methods && methods->empty())
+                type->tp_methods = static_methods;
+            else {
+                if (static_methods) {
+                    PyMethodDef *end = static_methods;
+                    while (end->ml_name)
+                        ++end;
+                    methods->insert(methods->begin(), static_methods, end);
+                }
+                PyMethodDef meth = {0};
+                methods->push_back(meth);
+                type->tp_methods = &methods->front();
+            }
+            PyGetSetDef gs = {0};
+            getset->push_back(gs);
             type->tp_getset = &getset->front();
+#ifdef CAPY_REFCOUNT_DIAGNOSTICS
+            refcount_register_methods(type->tp_methods, type->tp_name);
+            refcount_method_names()[(void *)check_call<Class::new_helper>] =
+                std::string(type->tp_name) + ".__new__";
+#endif
             if (PyType_Ready(type) == -1)
                 return;
             PyObject *py_members_cobj = PyCObject_FromVoidPtr(py_members, 0);
@@ -65,35 +270,122 @@ namespace Capy
             extension.add_object(type_name, Object((PyObject *)type));
         }
 
+        // Method table entries that can be built at compile time, for
+        // use in a static table passed to add_methods().
         template <typename RT, RT (Cls::*method)()>
-        void add_method(const char *name, const char *doc = 0)
+        static constexpr PyMethodDef
+        method_def(const char *name, const char *doc = 0)
         {
-            add_method_def(name, check_call<Class::call_method<RT, method> >, doc);
+            return {name, check_call<Class::call_method<RT, method> >,
+                    METH_VARARGS, doc};
+        }
+        template <void (Cls::*method)()>
+        static constexpr PyMethodDef
+        method_def(const char *name, const char *doc = 0)
+        {
+            return {name, check_call<Class::call_method<method> >,
+                    METH_VARARGS, doc};
+        }
+        template <typename RT, typename T, RT (Cls::*method)(T)>
+        static constexpr PyMethodDef
+        method_def(const char *name, const char *doc = 0)
+        {
+            return {name, check_call<Class::call_method<RT, T, method> >,
+                    METH_VARARGS, doc};
+        }
+        template <typename T, void (Cls::*method)(T)>
+        static constexpr PyMethodDef
+        method_def(const char *name, const char *doc = 0)
+        {
+            return {name, check_call<Class::call_method<T, method> >,
+                    METH_VARARGS, doc};
+        }
+        template <typename RT, typename T1, typename T2, RT (Cls::*method)(T1, T2)>
+        static constexpr PyMethodDef
+        method_def(const char *name, const char *doc = 0)
+        {
+            return {name, check_call<Class::call_method<RT, T1, T2, method> >,
+                    METH_VARARGS, doc};
+        }
+        template <typename T1, typename T2, void (Cls::*method)(T1, T2)>
+        static constexpr PyMethodDef
+        method_def(const char *name, const char *doc = 0)
+        {
+            return {name, check_call<Class::call_method<T1, T2, method> >,
+                    METH_VARARGS, doc};
+        }
+
+        // Add a zero-terminated static method table.  If there are no
+        // other methods, the table is used in place.
+        void add_methods(PyMethodDef *table)
+        {
+            if (!static_methods && methods->empty()) {
+                static_methods = table;
+                return;
+            }
+            for (; table->ml_name; ++table)
+                methods->push_back(*table);
+        }
+
+        // Every method name also gets a batched counterpart name_batch,
+        // which calls the method once per item of its argument and
+        // returns the results as a NumPy array if they are numbers and
+        // NumPy has been imported, otherwise as a list.  The items are
+        // the argument tuples, or the arguments themselves for methods
+        // of one argument; methods without arguments take the number of
+        // calls.  An error is reported with the index of the failing
+        // item.  Methods returning generators have no batched version.
+        // Pure methods returning a value can be memoized, see memo.hh.
+        template <typename RT, RT (Cls::*method)()>
+        void add_method(const char *name, const char *doc = 0,
+                        Memoize memo = Memoize())
+        {
+            add_method_def(name, memoize<check_call<Class::call_method<RT, method> > >(
+                               memo_name(name), memo), doc);
+            if constexpr (!KeepsOwner<RT>::value)
+                add_method_def(batch_name(name),
+                               check_call<Class::call_batch<RT, method> >, 0);
         }
         template <void (Cls::*method)()>
         void add_method(const char *name, const char *doc = 0)
         {
             add_method_def(name, check_call<Class::call_method<method> >, doc);
+            add_method_def(batch_name(name),
+                           check_call<Class::call_batch<method> >, 0);
         }
         template <typename RT, typename T, RT (Cls::*method)(T)>
-        void add_method(const char *name, const char *doc = 0)
+        void add_method(const char *name, const char *doc = 0,
+                        Memoize memo = Memoize())
         {
-            add_method_def(name, check_call<Class::call_method<RT, T, method> >, doc);
+            add_method_def(name, memoize<check_call<Class::call_method<RT, T, method> > >(
+                               memo_name(name), memo), doc);
+            if constexpr (!KeepsOwner<RT>::value)
+                add_method_def(batch_name(name),
+                               check_call<Class::call_batch<RT, T, method> >, 0);
         }
         template <typename T, void (Cls::*method)(T)>
         void add_method(const char *name, const char *doc = 0)
         {
             add_method_def(name, check_call<Class::call_method<T, method> >, doc);
+            add_method_def(batch_name(name),
+                           check_call<Class::call_batch<T, method> >, 0);
         }
         template <typename RT, typename T1, typename T2, RT (Cls::*method)(T1, T2)>
-        void add_method(const char *name, const char *doc = 0)
+        void add_method(const char *name, const char *doc = 0,
+                        Memoize memo = Memoize())
         {
-            add_method_def(name, check_call<Class::call_method<RT, T1, T2, method> >, doc);
+            add_method_def(name, memoize<check_call<Class::call_method<RT, T1, T2, method> > >(
+                               memo_name(name), memo), doc);
+            if constexpr (!KeepsOwner<RT>::value)
+                add_method_def(batch_name(name),
+                               check_call<Class::call_batch<RT, T1, T2, method> >, 0);
         }
         template <typename T1, typename T2, void (Cls::*method)(T1, T2)>
         void add_method(const char *name, const char *doc = 0)
         {
             add_method_def(name, check_call<Class::call_method<T1, T2, method> >, doc);
+            add_method_def(batch_name(name),
+                           check_call<Class::call_batch<T1, T2, method> >, 0);
         }
 
         template <typename T>
@@ -104,7 +396,39 @@ namespace Capy
                 {const_cast<char *>(name),
                  (getter)(PyObject *(*)(ClsObject *, T Cls::**))get_member<T>,
                  0, const_cast<char *>(doc), &members->back()};
-            getset->insert(getset->end() - 1, gs);
+            getset->push_back(gs);
+        }
+        // Members wrapped in Cached<T> return the same Python object until
+        // their value changes, and can be assigned from Python.
+        template <typename T>
+        void add_member(const char *name, Cached<T> Cls::*memb,
+                        const char *doc = 0)
+        {
+            members->push_back((int Cls::*)memb);
+            PyGetSetDef gs =
+                {const_cast<char *>(name),
+                 (getter)(PyObject *(*)(ClsObject *, Cached<T> Cls::**))
+                     get_cached<T>,
+                 (setter)(int (*)(ClsObject *, PyObject *, Cached<T> Cls::**))
+                     set_cached<T>,
+                 const_cast<char *>(doc), &members->back()};
+            getset->push_back(gs);
+        }
+        // Expose a vector member as a NumPy array sharing its storage.
+        // The same array is returned until the vector is reallocated or
+        // resized.  Arrays obtained before that keep the old storage
+        // alive, so they are never dangling, but show stale data.
+        template <typename T>
+        void add_array_member(const char *name, SharedVector<T> Cls::*memb,
+                              const char *doc = 0)
+        {
+            members->push_back((int Cls::*)memb);
+            PyGetSetDef gs =
+                {const_cast<char *>(name),
+                 (getter)(PyObject *(*)(ClsObject *, SharedVector<T> Cls::**))
+                     get_array_member<T>,
+                 0, const_cast<char *>(doc), &members->back()};
+            getset->push_back(gs);
         }
         template <typename T>
         void add_py_member(const char *name, T Cls::*memb,
@@ -117,15 +441,155 @@ namespace Capy
                 {const_cast<char *>(name),
                  (getter)(PyObject *(*)(ClsObject *, T Cls::**))get_member<T>,
                  0, const_cast<char *>(doc), &py_members->back()};
-            getset->insert(getset->end() - 1, gs);
+            getset->push_back(gs);
+        }
+
+        // Add a method run(steps, arg, observer=None, every=0) that calls
+        // step(arg) up to steps times in a C++ loop and returns the
+        // number of steps done.  observer(self, steps_done) is called
+        // after every every-th step, after a step for which condition
+        // returns true, and at the end; a true result stops the loop.
+        // Without an observer, a true condition stops the loop.  With
+        // release_gil, the steps and the condition run with the GIL
+        // released, so they must not use the Python API.
+        template <typename T, void (Cls::*step)(T),
+                  bool (Cls::*condition)() = (bool (Cls::*)())0>
+        void add_run_loop(const char *name, const char *doc = 0,
+                          bool release_gil = false)
+        {
+            PyCFunctionWithKeywords meth = release_gil ?
+                check_call_kw<Class::run_loop<T, step, condition, true> > :
+                check_call_kw<Class::run_loop<T, step, condition, false> >;
+            add_method_def(name, (PyCFunction)meth, doc,
+                           METH_VARARGS | METH_KEYWORDS);
+        }
+        // The same for steps without argument: run(steps, observer=None,
+        // every=0)
+        template <void (Cls::*step)(),
+                  bool (Cls::*condition)() = (bool (Cls::*)())0>
+        void add_run_loop(const char *name, const char *doc = 0,
+                          bool release_gil = false)
+        {
+            PyCFunctionWithKeywords meth = release_gil ?
+                check_call_kw<Class::run_loop<step, condition, true> > :
+                check_call_kw<Class::run_loop<step, condition, false> >;
+            add_method_def(name, (PyCFunction)meth, doc,
+                           METH_VARARGS | METH_KEYWORDS);
+        }
+
+        // Pointer to the C++ instance of a wrapped object.  Instances of
+        // Python subclasses are accepted as well.
+        static Cls *unwrap(PyObject *obj)
+        {
+            if (!registered_type)
+                throw TypeError("argument type has not been wrapped");
+            if (!PyObject_TypeCheck(obj, registered_type)) {
+                PyErr_Format(PyExc_TypeError,
+                             "argument must be %.200s, not %.200s",
+                             registered_type->tp_name, Py_TYPE(obj)->tp_name);
+                throw ExceptionInPythonAPI();
+            }
+            return ((ClsObject *)obj)->instance;
+        }
+
+        // Drop the memoized results of the methods of instance, to be
+        // called when its state changes.
+        static void invalidate_memo(Cls *instance)
+        {
+            typename Wrappers::iterator it = wrappers().find(instance);
+            if (it != wrappers().end())
+                Capy::invalidate_memo(it->second);
+        }
+
+        // Python object for an instance returned from C++, see
+        // ReturnConverter.  An existing wrapper of the instance is
+        // returned if there is one, otherwise a new one is created
+        // according to the return policy.
+        static PyObject *wrap(Cls *instance)
+        {
+            if (!instance)
+                Py_RETURN_NONE;
+            if (!registered_type)
+                throw TypeError("return type has not been wrapped");
+            typename Wrappers::iterator it = wrappers().find(instance);
+            if (it != wrappers().end()) {
+                Py_INCREF(it->second);
+                return it->second;
+            }
+            ClsObject *self = (ClsObject *)check_error(
+                registered_type->tp_alloc(registered_type, 0));
+            self->instance = instance;
+            self->owned = return_policy == Owned;
+            wrappers()[instance] = (PyObject *)self;
+            return (PyObject *)self;
+        }
+
+        // Report the memory used by an instance beyond sizeof(Cls), e.g.
+        // by its vectors, in __sizeof__() and _capy_memory_summary().
+        template <size_t (Cls::*memory_usage)() const>
+        void set_sizeof()
+        {
+            sizeof_hook = call_sizeof<memory_usage>;
+            add_method_def("__sizeof__", check_call<Class::sizeof_method>,
+                           "Size of the object including the C++ instance.");
+        }
+
+        // Whether wrappers created for returned instances delete them.
+        // Borrowed instances must outlive their wrappers.
+        void set_return_policy(ReturnPolicy policy)
+        {
+            return_policy = policy;
+        }
+
+        // Make instances picklable.  The save hook stores the state of
+        // an instance as binary data; for unpickling, a new instance is
+        // constructed and the state is restored by the load hook.  The
+        // new instance gets the configuration stored in the member
+        // config if given, which is pickled along, otherwise an empty
+        // one.
+        template <void (Cls::*save)(StateWriter &),
+                  void (Cls::*load)(StateReader &),
+                  Mapping Cls::*config = (Mapping Cls::*)0>
+        void add_pickle()
+        {
+            add_method_def("__reduce__",
+                           check_call<Class::reduce<save, config> >, 0);
+            add_method_def("__setstate__",
+                           check_call<Class::setstate<load> >, 0);
         }
 
     private:
         void add_method_def(const char *name, PyCFunction meth,
-                            const char *doc)
+                            const char *doc, int flags = METH_VARARGS)
         {
-            PyMethodDef def = {name, meth, METH_VARARGS, doc};
-            methods->insert(methods->end() - 1, def);
+            PyMethodDef def = {name, meth, flags, doc};
+            methods->push_back(def);
+        }
+
+        std::string memo_name(const char *name) const
+        {
+            return std::string(type->tp_name) + "." + name;
+        }
+
+        const char *batch_name(const char *name)
+        {
+            return extension.keep_name(std::string(name) + "_batch");
+        }
+
+        static const char *base_name(const char *name)
+        {
+            const char *dot = strrchr(name, '.');
+            return dot ? dot + 1 : name;
+        }
+
+        // Results referring to the instance also get its wrapper.
+        template <typename RT>
+        static PyObject *convert_result(PyObject *self_obj, RT result)
+        {
+            if constexpr (KeepsOwner<RT>::value)
+                return ReturnConverter<RT>::convert(std::move(result), self_obj);
+            else
+                return ReturnConverter<RT>::convert(result);
         }
 
         template <typename RT, RT (Cls::*method)()>
@@ -135,7 +599,7 @@ namespace Capy
             ClsObject *self = (ClsObject *)self_obj;
             if (!PyArg_ParseTuple(args, ""))
                 return 0;
-            return Object((self->instance->*method)()).new_reference();
+            return convert_result<RT>(self_obj, (self->instance->*method)());
         }
         template <void (Cls::*method)()>
         static PyObject *
@@ -155,8 +619,9 @@ namespace Capy
             PyObject *py_arg1;
             if (!PyArg_ParseTuple(args, "O", &py_arg1))
                 return 0;
-            return Object((self->instance->*method)
-                          (Object(py_arg1).new_reference())).new_reference();
+            return convert_result<RT>(
+                self_obj,
+                (self->instance->*method)(ArgConverter<T>::convert(py_arg1)));
         }
         template <typename T, void (Cls::*method)(T)>
         static PyObject *
@@ -166,7 +631,7 @@ namespace Capy
             PyObject *py_arg1;
             if (!PyArg_ParseTuple(args, "O", &py_arg1))
                 return 0;
-            (self->instance->*method)(Object(py_arg1).new_reference());
+            (self->instance->*method)(ArgConverter<T>::convert(py_arg1));
             Py_RETURN_NONE;
         }
         template <typename RT, typename T1, typename T2, RT (Cls::*method)(T1, T2)>
@@ -178,9 +643,10 @@ namespace Capy
             PyObject *py_arg2;
             if (!PyArg_ParseTuple(args, "OO", &py_arg1, &py_arg2))
                 return 0;
-            return Object((self->instance->*method)
-                          (Object(py_arg1).new_reference(),
-                           Object(py_arg2).new_reference())).new_reference();
+            return convert_result<RT>(
+                self_obj,
+                (self->instance->*method)(ArgConverter<T1>::convert(py_arg1),
+                                          ArgConverter<T2>::convert(py_arg2)));
         }
         template <typename T1, typename T2, void (Cls::*method)(T1, T2)>
         static PyObject *
@@ -191,8 +657,218 @@ namespace Capy
             PyObject *py_arg2;
             if (!PyArg_ParseTuple(args, "OO", &py_arg1, &py_arg2))
                 return 0;
-            (self->instance->*method)(Object(py_arg1).new_reference(),
-                                      Object(py_arg2).new_reference());
+            (self->instance->*method)(ArgConverter<T1>::convert(py_arg1),
+                                      ArgConverter<T2>::convert(py_arg2));
+            Py_RETURN_NONE;
+        }
+
+        template <typename RT, typename Call>
+        static PyObject *
+        batch_loop(PyObject *self_obj, PyObject *args, int nargs, Call call)
+        {
+            Cls *instance = ((ClsObject *)self_obj)->instance;
+            PyObject *items;
+            if (!PyArg_ParseTuple(args, "O", &items))
+                return 0;
+            Object seq = nargs ? Object(PySequence_Fast(
+                                            items, "expected a sequence"))
+                : Object(Py_None).new_reference();
+            Py_ssize_t n = nargs ? PySequence_Fast_GET_SIZE((PyObject *)seq)
+                : check_error(PyInt_AsSsize_t(items));
+            BatchResults<RT> results(n);
+            Py_ssize_t i = 0;
+            try {
+                for (; i < n; ++i) {
+                    PyObject *item = nargs ? PySequence_Fast_GET_ITEM(
+                        (PyObject *)seq, i) : 0;
+                    Object arg_tuple = nargs > 1 ? Object(PySequence_Fast(
+                        item, "expected a tuple of arguments"))
+                        : Object(Py_None).new_reference();
+                    PyObject **item_args = &item;
+                    if (nargs > 1) {
+                        if (PySequence_Fast_GET_SIZE((PyObject *)arg_tuple) !=
+                            nargs) {
+                            PyErr_Format(PyExc_TypeError,
+                                         "expected %d arguments, got %zd", nargs,
+                                         PySequence_Fast_GET_SIZE(
+                                             (PyObject *)arg_tuple));
+                            throw ExceptionInPythonAPI();
+                        }
+                        item_args = PySequence_Fast_ITEMS((PyObject *)arg_tuple);
+                    }
+                    if constexpr (std::is_void<RT>::value)
+                        call(instance, item_args);
+                    else
+                        results.set(i, call(instance, item_args));
+                }
+            }
+            catch (...) {
+                translate_exception();
+                prefix_error("batch item " + std::to_string(i));
+                return 0;
+            }
+            return results.release();
+        }
+
+        template <typename RT, RT (Cls::*method)()>
+        static PyObject *
+        call_batch(PyObject *self, PyObject *args)
+        {
+            return batch_loop<RT>(
+                self, args, 0, [](Cls *instance, PyObject **) -> RT {
+                    return (instance->*method)();
+                });
+        }
+        template <void (Cls::*method)()>
+        static PyObject *
+        call_batch(PyObject *self, PyObject *args)
+        {
+            return batch_loop<void>(
+                self, args, 0, [](Cls *instance, PyObject **) {
+                    (instance->*method)();
+                });
+        }
+        template <typename RT, typename T, RT (Cls::*method)(T)>
+        static PyObject *
+        call_batch(PyObject *self, PyObject *args)
+        {
+            return batch_loop<RT>(
+                self, args, 1, [](Cls *instance, PyObject **a) -> RT {
+                    return (instance->*method)(ArgConverter<T>::convert(a[0]));
+                });
+        }
+        template <typename T, void (Cls::*method)(T)>
+        static PyObject *
+        call_batch(PyObject *self, PyObject *args)
+        {
+            return batch_loop<void>(
+                self, args, 1, [](Cls *instance, PyObject **a) {
+                    (instance->*method)(ArgConverter<T>::convert(a[0]));
+                });
+        }
+        template <typename RT, typename T1, typename T2, RT (Cls::*method)(T1, T2)>
+        static PyObject *
+        call_batch(PyObject *self, PyObject *args)
+        {
+            return batch_loop<RT>(
+                self, args, 2, [](Cls *instance, PyObject **a) -> RT {
+                    return (instance->*method)(ArgConverter<T1>::convert(a[0]),
+                                               ArgConverter<T2>::convert(a[1]));
+                });
+        }
+        template <typename T1, typename T2, void (Cls::*method)(T1, T2)>
+        static PyObject *
+        call_batch(PyObject *self, PyObject *args)
+        {
+            return batch_loop<void>(
+                self, args, 2, [](Cls *instance, PyObject **a) {
+                    (instance->*method)(ArgConverter<T1>::convert(a[0]),
+                                        ArgConverter<T2>::convert(a[1]));
+                });
+        }
+
+        template <bool (Cls::*condition)(), bool release_gil, typename Step>
+        static PyObject *
+        run_steps(PyObject *self_obj, long steps, PyObject *observer,
+                  long every, Step step)
+        {
+            Cls *instance = ((ClsObject *)self_obj)->instance;
+            if (observer == Py_None)
+                observer = 0;
+            long done = 0;
+            while (done < steps) {
+                long chunk = steps - done;
+                if (observer && every > 0)
+                    chunk = std::min(chunk, every - done % every);
+                bool triggered = false;
+                {
+                    std::optional<AllowThreads> allow;
+                    if constexpr (release_gil)
+                        allow.emplace();
+                    for (long i = 0; i < chunk && !triggered; ++i) {
+                        step(instance);
+                        ++done;
+                        if constexpr (condition != 0)
+                            triggered = (instance->*condition)();
+                    }
+                }
+                check_error(PyErr_CheckSignals());
+                if (!observer) {
+                    if (triggered)
+                        break;
+                    continue;
+                }
+                if (Object(PyObject_CallFunction(
+                               observer, (char *)"Ol", self_obj, done)))
+                    break;
+            }
+            return Object(done).new_reference();
+        }
+        template <typename T, void (Cls::*step)(T),
+                  bool (Cls::*condition)(), bool release_gil>
+        static PyObject *
+        run_loop(PyObject *self, PyObject *args, PyObject *kwargs)
+        {
+            static const char *keywords[] = {
+                "steps", "arg", "observer", "every", 0};
+            long steps;
+            PyObject *py_arg;
+            PyObject *observer = Py_None;
+            long every = 0;
+            if (!PyArg_ParseTupleAndKeywords(args, kwargs, "lO|Ol",
+                                             (char **)keywords, &steps,
+                                             &py_arg, &observer, &every))
+                return 0;
+            T arg = ArgConverter<T>::convert(py_arg);
+            return run_steps<condition, release_gil>(
+                self, steps, observer, every,
+                [&](Cls *instance) { (instance->*step)(arg); });
+        }
+        template <void (Cls::*step)(), bool (Cls::*condition)(),
+                  bool release_gil>
+        static PyObject *
+        run_loop(PyObject *self, PyObject *args, PyObject *kwargs)
+        {
+            static const char *keywords[] = {"steps", "observer", "every", 0};
+            long steps;
+            PyObject *observer = Py_None;
+            long every = 0;
+            if (!PyArg_ParseTupleAndKeywords(args, kwargs, "l|Ol",
+                                             (char **)keywords, &steps,
+                                             &observer, &every))
+                return 0;
+            return run_steps<condition, release_gil>(
+                self, steps, observer, every,
+                [](Cls *instance) { (instance->*step)(); });
+        }
+
+        template <void (Cls::*save)(StateWriter &), Mapping Cls::*config>
+        static PyObject *
+        reduce(PyObject *self_obj, PyObject *args)
+        {
+            ClsObject *self = (ClsObject *)self_obj;
+            if (!PyArg_ParseTuple(args, ""))
+                return 0;
+            StateWriter state;
+            (self->instance->*save)(state);
+            Object blob = state.result();
+            Object new_args(PyTuple_New(0));
+            if (config != (Mapping Cls::*)0)
+                new_args = Object(PyTuple_Pack(
+                    1, (PyObject *)(self->instance->*config)));
+            return PyTuple_Pack(3, (PyObject *)Py_TYPE(self_obj),
+                                (PyObject *)new_args, (PyObject *)blob);
+        }
+        template <void (Cls::*load)(StateReader &)>
+        static PyObject *
+        setstate(PyObject *self_obj, PyObject *args)
+        {
+            ClsObject *self = (ClsObject *)self_obj;
+            PyObject *py_state;
+            if (!PyArg_ParseTuple(args, "O", &py_state))
+                return 0;
+            StateReader state(Object(py_state).new_reference());
+            (self->instance->*load)(state);
             Py_RETURN_NONE;
         }
 
@@ -202,6 +878,8 @@ namespace Capy
             Mapping config(map);
             try {
                 ((ClsObject *)self)->instance = new Cls(config);
+                ((ClsObject *)self)->owned = true;
+                wrappers()[((ClsObject *)self)->instance] = self;
             }
             catch (...) {
                 Py_DECREF(self);
@@ -248,10 +926,87 @@ namespace Capy
             }
         }
 
+        template <typename T>
+        static PyObject *get_cached(ClsObject *self, Cached<T> Cls::**memb)
+        {
+            try {
+                return (self->instance->**memb).object();
+            }
+            catch (ExceptionInPythonAPI&) {
+                return 0;
+            }
+        }
+        template <typename T>
+        static int set_cached(ClsObject *self, PyObject *value,
+                              Cached<T> Cls::**memb)
+        {
+            if (!value) {
+                PyErr_SetString(PyExc_TypeError, "can't delete attribute");
+                return -1;
+            }
+            try {
+                T converted = Object(value).new_reference();
+                self->instance->**memb = converted;
+                return 0;
+            }
+            catch (ExceptionInPythonAPI&) {
+                return -1;
+            }
+            catch (Exception &e) {
+                e.raise();
+                return -1;
+            }
+        }
+
+        // The views are cached as weak references, so dropping them
+        // releases old storage.
+        template <typename T>
+        static PyObject *get_array_member(ClsObject *self,
+                                          SharedVector<T> Cls::**memb)
+        {
+            try {
+                SharedVector<T> &v = self->instance->**memb;
+                if (!self->views)
+                    self->views = new Views;
+                View &cached = (*self->views)[memb];
+                if (cached.ref && cached.data == v.data() &&
+                    cached.size == v.size()) {
+                    PyObject *view = PyWeakref_GET_OBJECT(cached.ref);
+                    if (view != Py_None) {
+                        Py_INCREF(view);
+                        return view;
+                    }
+                }
+                Object view(vector_view(v));
+                PyObject *ref = check_error(PyWeakref_NewRef(view, 0));
+                Py_XDECREF(cached.ref);
+                View entry = {ref, v.data(), v.size()};
+                cached = entry;
+                return view.new_reference();
+            }
+            catch (ExceptionInPythonAPI&) {
+                return 0;
+            }
+        }
+
         static void
         dealloc(ClsObject *self)
         {
-            delete self->instance;
+            Capy::invalidate_memo((PyObject *)self);
+            if (self->views) {
+                for (typename Views::iterator it = self->views->begin();
+                     it != self->views->end(); ++it)
+                    Py_XDECREF(it->second.ref);
+                delete self->views;
+            }
+            if (self->instance) {
+                typename Wrappers::iterator it =
+                    wrappers().find(self->instance);
+                if (it != wrappers().end() && it->second == (PyObject *)self)
+                    wrappers().erase(it);
+            }
+            if (self->owned)
+                delete self->instance;
             PyObject_GC_UnTrack(self);
             self->ob_type->tp_free((PyObject *)self);
         }
@@ -265,9 +1020,10 @@ namespace Capy
                 PyErr_Clear();
                 return 0;
             }
-            typedef std::vector<Object Cls::*> PyMembers;
-            PyMembers py_members =
+            typedef std::deque<Object Cls::*> PyMembers;
+            const PyMembers &py_members =
                 *(PyMembers *)PyCObject_AsVoidPtr(py_members_cobj);
+            Py_DECREF(py_members_cobj);
             for (unsigned i = 0; i < py_members.size(); ++i) {
                 PyObject *ob = self->instance->*py_members[i];
                 Py_VISIT(ob);
@@ -275,12 +1031,63 @@ namespace Capy
             return 0;
         }
 
+        // Wrappers of the live instances, without holding references
+        typedef std::unordered_map<const Cls *, PyObject *> Wrappers;
+        static Wrappers &wrappers()
+        {
+            static Wrappers *wrappers = new Wrappers;
+            return *wrappers;
+        }
+
+        template <size_t (Cls::*memory_usage)() const>
+        static size_t call_sizeof(const Cls *instance)
+        {
+            return (instance->*memory_usage)();
+        }
+        static size_t instance_size(const Cls *instance)
+        {
+            return sizeof(Cls) + (sizeof_hook ? sizeof_hook(instance) : 0);
+        }
+        static PyObject *
+        sizeof_method(PyObject *self_obj, PyObject *args)
+        {
+            ClsObject *self = (ClsObject *)self_obj;
+            if (!PyArg_ParseTuple(args, ""))
+                return 0;
+            size_t size = Py_TYPE(self)->tp_basicsize;
+            if (self->instance)
+                size += instance_size(self->instance);
+            return PyInt_FromSize_t(size);
+        }
+        static void memory_summary(size_t *instances, size_t *bytes)
+        {
+            *instances = wrappers().size();
+            *bytes = 0;
+            for (typename Wrappers::iterator it = wrappers().begin();
+                 it != wrappers().end(); ++it)
+                *bytes += Py_TYPE(it->second)->tp_basicsize +
+                    instance_size(it->first);
+        }
+
+        static PyTypeObject *registered_type;
+        static ReturnPolicy return_policy;
+        static size_t (*sizeof_hook)(const Cls *);
+
         PyTypeObject *type;
         std::vector<PyMethodDef> *methods;
-        std::vector<int Cls::*> *members;
-        std::vector<Object Cls::*> *py_members;
+        PyMethodDef *static_methods;
+        // Deques keep the getset closures pointing into them valid
+        std::deque<int Cls::*> *members;
+        std::deque<Object Cls::*> *py_members;
         std::vector<PyGetSetDef> *getset;
     };
+
+    template <typename Cls>
+    PyTypeObject *Class<Cls>::registered_type = 0;
+    template <typename Cls>
+    ReturnPolicy Class<Cls>::return_policy = Borrowed;
+    template <typename Cls>
+    size_t (*Class<Cls>::sizeof_hook)(const Cls *) = 0;
 }
 
 #endif
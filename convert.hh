@@ -0,0 +1,355 @@
+#ifndef CAPY_CONVERT_HH
+#define CAPY_CONVERT_HH
+
+#include <type_traits>
+
+// This header contains the conversion of Python arguments to the
+// parameter types of wrapped functions and methods, and of their return
+// values to Python objects, as well as typed container parameters.
+
+// Declare Cls as wrapped with Class, see IsWrapped.
+#define CAPY_WRAPPED(Cls) \
+    namespace Capy { template <> struct IsWrapped<Cls> : std::true_type {}; }
+
+namespace Capy
+{
+    template <typename Cls>
+    class Class;
+
+    // Classes wrapped with Class, declared with CAPY_WRAPPED(Cls) at
+    // global scope before they are used as parameter or return types.
+    // Other types are converted from and to Object, so unsupported types
+    // fail to compile.
+    template <typename T>
+    struct IsWrapped : std::false_type
+    {};
+    template <typename T>
+    struct IsWrapped<const T> : IsWrapped<T>
+    {};
+
+    // Arguments are passed on as Object and converted implicitly to the
+    // parameter type.
+    template <typename T>
+    struct ObjectArg
+    {
+        static Object convert(PyObject *obj)
+        {
+            return Object(obj).new_reference();
+        }
+    };
+
+    // Pointers and references to wrapped classes are passed on as
+    // pointers to the C++ instance after a single type check.  None is
+    // accepted for pointers.
+    template <typename T>
+    struct WrappedPointerArg
+    {
+        static T *convert(PyObject *obj)
+        {
+            if (obj == Py_None)
+                return 0;
+            return Class<typename std::remove_const<T>::type>::unwrap(obj);
+        }
+    };
+    template <typename T>
+    struct WrappedReferenceArg
+    {
+        static T &convert(PyObject *obj)
+        {
+            return *Class<typename std::remove_const<T>::type>::unwrap(obj);
+        }
+    };
+
+    // Ownership of instances of wrapped classes returned from C++, see
+    // Class::set_return_policy()
+    enum ReturnPolicy
+    {
+        Borrowed,
+        Owned
+    };
+
+    // Return values are converted to Object, except for pointers and
+    // references to wrapped classes, which are converted to the wrapper
+    // of the instance.
+    template <typename T>
+    struct ObjectReturn
+    {
+        static PyObject *convert(const T &value)
+        {
+            return Object(value).new_reference();
+        }
+    };
+    template <typename T>
+    struct WrappedReturn
+    {
+        static PyObject *convert(T *instance)
+        {
+            return Class<typename std::remove_const<T>::type>::wrap(
+                const_cast<typename std::remove_const<T>::type *>(instance));
+        }
+        static PyObject *convert(T &instance)
+        {
+            return convert(&instance);
+        }
+    };
+
+    // Return values referring to the instance they were returned from,
+    // like generators (generator.hh), are converted together with the
+    // wrapper of the instance to keep it alive.
+    template <typename T>
+    struct KeepsOwner : std::false_type
+    {};
+
+    template <typename T>
+    struct ReturnConverter : ObjectReturn<T>
+    {};
+    template <typename T>
+    struct ReturnConverter<T *>
+        : std::conditional<IsWrapped<T>::value,
+                           WrappedReturn<T>, ObjectReturn<T *> >::type
+    {};
+    template <typename T>
+    struct ReturnConverter<T &>
+        : std::conditional<IsWrapped<T>::value,
+                           WrappedReturn<T>, ObjectReturn<T> >::type
+    {};
+
+    template <typename T>
+    struct ArgConverter
+        : std::conditional<IsWrapped<T>::value,
+                           WrappedReferenceArg<T>, ObjectArg<T> >::type
+    {};
+    template <typename T>
+    struct ArgConverter<T *>
+        : std::conditional<IsWrapped<T>::value,
+                           WrappedPointerArg<T>, ObjectArg<T *> >::type
+    {};
+    template <typename T>
+    struct ArgConverter<T &>
+        : std::conditional<IsWrapped<T>::value,
+                           WrappedReferenceArg<T>, ObjectArg<T &> >::type
+    {};
+
+    // Conversion of the items of TypedList and TypedDict.  Numbers and
+    // strings are checked strictly, so e.g. a float isn't silently
+    // truncated to an integer; other types go through ArgConverter.
+    template <typename T>
+    struct ItemConverter
+    {
+        static constexpr const char *name = "object";
+        static bool check(PyObject *)
+        {
+            return true;
+        }
+        static T convert(PyObject *obj)
+        {
+            return ArgConverter<T>::convert(obj);
+        }
+    };
+    template <>
+    struct ItemConverter<double>
+    {
+        static constexpr const char *name = "float";
+        static bool check(PyObject *obj)
+        {
+            return PyFloat_Check(obj) || PyLong_Check(obj) ||
+                (PyInt_Check(obj) && !PyBool_Check(obj));
+        }
+        static double convert(PyObject *obj)
+        {
+            return check_error(PyFloat_AsDouble(obj));
+        }
+    };
+    template <>
+    struct ItemConverter<long>
+    {
+        static constexpr const char *name = "int";
+        static bool check(PyObject *obj)
+        {
+            return (PyInt_Check(obj) && !PyBool_Check(obj)) || PyLong_Check(obj);
+        }
+        static long convert(PyObject *obj)
+        {
+            return check_error(PyInt_AsLong(obj));
+        }
+    };
+    template <>
+    struct ItemConverter<int> : ItemConverter<long>
+    {
+        static int convert(PyObject *obj)
+        {
+            long value = ItemConverter<long>::convert(obj);
+            if (value != (int)value)
+                throw OverflowError("integer out of range");
+            return value;
+        }
+    };
+    template <>
+    struct ItemConverter<bool>
+    {
+        static constexpr const char *name = "bool";
+        static bool check(PyObject *obj)
+        {
+            return PyBool_Check(obj);
+        }
+        static bool convert(PyObject *obj)
+        {
+            return obj == Py_True;
+        }
+    };
+    template <>
+    struct ItemConverter<std::string>
+    {
+        static constexpr const char *name = "str";
+        static bool check(PyObject *obj)
+        {
+            return PyString_Check(obj);
+        }
+        static std::string convert(PyObject *obj)
+        {
+            return std::string(PyString_AS_STRING(obj),
+                               PyString_GET_SIZE(obj));
+        }
+    };
+
+    template <typename T>
+    T convert_item(PyObject *item)
+    {
+        if (!ItemConverter<T>::check(item)) {
+            PyErr_Format(PyExc_TypeError, "expected %s, got %.200s",
+                         ItemConverter<T>::name, Py_TYPE(item)->tp_name);
+            throw ExceptionInPythonAPI();
+        }
+        return ItemConverter<T>::convert(item);
+    }
+
+    // Parameter types for lists and dictionaries whose items are checked
+    // and converted once when the wrapped function is called, so the
+    // function body can access them without further checks.  Errors
+    // tell which item is wrong, e.g. "list item 3: expected float, got
+    // str".  Later changes of the Python object aren't reflected.
+    template <typename T>
+    class TypedList : public Object
+    {
+    public:
+        typedef typename std::vector<T>::const_iterator iterator;
+
+        TypedList(const Object &other)
+            : Object(other)
+        {
+            if (!PyList_Check(self)) {
+                PyErr_Format(PyExc_TypeError,
+                             "argument must be a list, not %.200s",
+                             Py_TYPE(self)->tp_name);
+                throw ExceptionInPythonAPI();
+            }
+            Py_ssize_t i = 0;
+            try {
+                values.reserve(PyList_GET_SIZE(self));
+                for (; i < PyList_GET_SIZE(self); ++i)
+                    values.push_back(convert_item<T>(PyList_GET_ITEM(self, i)));
+            }
+            catch (...) {
+                translate_exception();
+                prefix_error("list item " + std::to_string(i));
+                throw ExceptionInPythonAPI();
+            }
+        }
+        size_t size() const
+        {
+            return values.size();
+        }
+        const T &operator[](size_t i) const
+        {
+            return values[i];
+        }
+        iterator begin() const
+        {
+            return values.begin();
+        }
+        iterator end() const
+        {
+            return values.end();
+        }
+        const std::vector<T> &vector() const
+        {
+            return values;
+        }
+    private:
+        std::vector<T> values;
+    };
+
+    // The items are kept in the dictionary's iteration order.
+    template <typename K, typename V>
+    class TypedDict : public Object
+    {
+    public:
+        typedef std::pair<K, V> Item;
+        typedef typename std::vector<Item>::const_iterator iterator;
+
+        TypedDict(const Object &other)
+            : Object(other)
+        {
+            if (!PyDict_Check(self)) {
+                PyErr_Format(PyExc_TypeError,
+                             "argument must be a dictionary, not %.200s",
+                             Py_TYPE(self)->tp_name);
+                throw ExceptionInPythonAPI();
+            }
+            entries.reserve(PyDict_Size(self));
+            Py_ssize_t pos = 0;
+            PyObject *key;
+            PyObject *value;
+            while (PyDict_Next(self, &pos, &key, &value)) {
+                bool converting_key = true;
+                try {
+                    K k = convert_item<K>(key);
+                    converting_key = false;
+                    entries.push_back(Item(k, convert_item<V>(value)));
+                }
+                catch (...) {
+                    translate_exception();
+                    PyObject *type, *error, *traceback;
+                    PyErr_Fetch(&type, &error, &traceback);
+                    PyObject *repr = PyObject_Repr(key);
+                    if (!repr) {
+                        Py_XDECREF(type);
+                        Py_XDECREF(error);
+                        Py_XDECREF(traceback);
+                        throw ExceptionInPythonAPI();
+                    }
+                    PyErr_Restore(type, error, traceback);
+                    std::string key_repr = PyString_AsString(repr);
+                    Py_DECREF(repr);
+                    prefix_error((converting_key ? "dict key " :
+                                  "value of dict key ") + key_repr);
+                    throw ExceptionInPythonAPI();
+                }
+            }
+        }
+        size_t size() const
+        {
+            return entries.size();
+        }
+        const Item &operator[](size_t i) const
+        {
+            return entries[i];
+        }
+        iterator begin() const
+        {
+            return entries.begin();
+        }
+        iterator end() const
+        {
+            return entries.end();
+        }
+        const std::vector<Item> &items() const
+        {
+            return entries;
+        }
+    private:
+        std::vector<Item> entries;
+    };
+}
+
+#endif
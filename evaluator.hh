@@ -0,0 +1,572 @@
+#ifndef CAPY_EVALUATOR_HH
+#define CAPY_EVALUATOR_HH
+
+#include "capy.hh"
+#include <code.h>
+#include <opcode.h>
+
+#include <math.h>
+
+// This header contains an evaluator for Python callbacks of
+// floating-point arguments.  Functions consisting of a single
+// arithmetic expression, like "lambda x: 2 * x + math.sin(x)", are
+// translated from their bytecode into a small native program, which
+// is run without entering the interpreter and without needing the GIL.
+// The supported subset consists of the arithmetic operators,
+// comparisons, numeric literals, the functions and constants from the
+// math module and the builtins abs, min, max and pow.  Everything else
+// is called through the interpreter.
+
+namespace Capy
+{
+    class Evaluator
+    {
+    public:
+        // func is either a callable or a string.  A string is evaluated
+        // with everything from the math module in scope; if it doesn't
+        // start with "lambda", it is taken as an expression in x.
+        explicit Evaluator(Object func_, int nargs_ = 1)
+            : func(func_), nargs(nargs_), native_(false), depth(0)
+        {
+            if (nargs < 0 || nargs > 4)
+                throw ValueError("an evaluator takes up to four arguments");
+            if (PyString_Check(func)) {
+                std::string expr(func);
+                if (expr.compare(0, 6, "lambda"))
+                    expr = "lambda x: " + expr;
+                Dict globals;
+                exec("from math import *\nimport math", globals);
+                func = eval(expr.c_str(), globals);
+            }
+            native_ = compile();
+            if (!native_)
+                program.clear();
+        }
+
+        // Whether func has been translated into a native program, so it
+        // can be called without holding the GIL.
+        bool native() const
+        {
+            return native_;
+        }
+
+        double operator()(double x) const
+        {
+            if (native_)
+                return run(&x);
+            return func(x);
+        }
+        double operator()(double x1, double x2) const
+        {
+            if (native_) {
+                double args[] = {x1, x2};
+                return run(args);
+            }
+            return func(x1, x2);
+        }
+        double call(const double *args) const
+        {
+            if (native_)
+                return run(args);
+            switch (nargs) {
+            case 0:
+                return func();
+            case 1:
+                return func(args[0]);
+            case 2:
+                return func(args[0], args[1]);
+            case 3:
+                return func(args[0], args[1], args[2]);
+            default:
+                return func(args[0], args[1], args[2], args[3]);
+            }
+        }
+
+        // Set y[i] = func(x[i]) for a function of one argument.  A native
+        // program runs with the GIL released.
+        void evaluate(const double *x, double *y, size_t n) const
+        {
+            if (!native_) {
+                for (size_t i = 0; i < n; ++i)
+                    y[i] = func(x[i]);
+                return;
+            }
+            AllowThreads allow;
+            for (size_t i = 0; i < n; ++i)
+                y[i] = run(&x[i]);
+        }
+
+        operator Object() const
+        {
+            return func;
+        }
+
+    private:
+        enum Opcode
+        {
+            PushArg, PushConst, Add, Subtract, Multiply, Divide,
+            FloorDivide, Modulo, Power, Negate, Less, LessEqual, Equal,
+            NotEqual, Greater, GreaterEqual, Call1, Call2
+        };
+
+        struct Instruction
+        {
+            Opcode op;
+            int arg;
+            double value;
+            double (*f1)(double);
+            double (*f2)(double, double);
+            bool can_overflow;
+        };
+
+        struct Function
+        {
+            const char *name;
+            int nargs;
+            double (*f1)(double);
+            double (*f2)(double, double);
+            bool can_overflow;
+        };
+
+        static const int max_depth = 32;
+
+        double run(const double *args) const
+        {
+            double stack[max_depth];
+            double *sp = stack;
+            for (size_t i = 0; i < program.size(); ++i) {
+                const Instruction &ins = program[i];
+                switch (ins.op) {
+                case PushArg:
+                    *sp++ = args[ins.arg];
+                    continue;
+                case PushConst:
+                    *sp++ = ins.value;
+                    continue;
+                case Negate:
+                    sp[-1] = -sp[-1];
+                    continue;
+                case Call1:
+                    sp[-1] = check_math(ins.f1(sp[-1]), sp[-1], sp[-1],
+                                        ins.can_overflow);
+                    continue;
+                default:
+                    break;
+                }
+                double b = *--sp;
+                double a = sp[-1];
+                double r;
+                switch (ins.op) {
+                case Add:
+                    r = a + b;
+                    break;
+                case Subtract:
+                    r = a - b;
+                    break;
+                case Multiply:
+                    r = a * b;
+                    break;
+                case Divide:
+                    if (b == 0)
+                        throw ZeroDivisionError("float division by zero");
+                    r = a / b;
+                    break;
+                case FloorDivide:
+                    r = floor_divide(a, b);
+                    break;
+                case Modulo:
+                    r = modulo(a, b);
+                    break;
+                case Power:
+                    r = power(a, b);
+                    break;
+                case Less:
+                    r = a < b;
+                    break;
+                case LessEqual:
+                    r = a <= b;
+                    break;
+                case Equal:
+                    r = a == b;
+                    break;
+                case NotEqual:
+                    r = a != b;
+                    break;
+                case Greater:
+                    r = a > b;
+                    break;
+                case GreaterEqual:
+                    r = a >= b;
+                    break;
+                default:
+                    r = check_math(ins.f2(a, b), a, b, ins.can_overflow);
+                    break;
+                }
+                sp[-1] = r;
+            }
+            return stack[0];
+        }
+
+        // The following functions reproduce the semantics of Python's
+        // float operations, including the exceptions raised.
+        static double modulo(double a, double b)
+        {
+            if (b == 0)
+                throw ZeroDivisionError("float modulo");
+            double mod = fmod(a, b);
+            if (mod) {
+                if ((b < 0) != (mod < 0))
+                    mod += b;
+            }
+            else
+                mod = copysign(0.0, b);
+            return mod;
+        }
+        static double floor_divide(double a, double b)
+        {
+            if (b == 0)
+                throw ZeroDivisionError("float divmod()");
+            double mod = fmod(a, b);
+            double div = (a - mod) / b;
+            if (mod && (b < 0) != (mod < 0))
+                div -= 1.0;
+            if (!div)
+                return copysign(0.0, a / b);
+            double floordiv = floor(div);
+            if (div - floordiv > 0.5)
+                floordiv += 1.0;
+            return floordiv;
+        }
+        static double power(double a, double b)
+        {
+            if (b == 0)
+                return 1.0;
+            if (a == 0 && b < 0)
+                throw ZeroDivisionError(
+                    "0.0 cannot be raised to a negative power");
+            if (a < 0 && b != floor(b))
+                throw ValueError(
+                    "negative number cannot be raised to a fractional power");
+            return check_math(pow(a, b), a, b, true);
+        }
+        static double check_math(double r, double a, double b,
+                                 bool can_overflow)
+        {
+            if (isnan(r) && !isnan(a) && !isnan(b))
+                throw ValueError("math domain error");
+            if (isinf(r) && isfinite(a) && isfinite(b)) {
+                if (can_overflow)
+                    throw OverflowError("math range error");
+                throw ValueError("math domain error");
+            }
+            return r;
+        }
+        static double math_pow(double a, double b)
+        {
+            if (a == 0 && b < 0)
+                throw ValueError("math domain error");
+            return pow(a, b);
+        }
+        static double log_base(double x, double base)
+        {
+            double den = log(base);
+            if (den == 0)
+                throw ZeroDivisionError("float division by zero");
+            return log(x) / den;
+        }
+        static double builtin_min(double a, double b)
+        {
+            return b < a ? b : a;
+        }
+        static double builtin_max(double a, double b)
+        {
+            return b > a ? b : a;
+        }
+
+        static const Function *math_functions()
+        {
+            static const Function functions[] = {
+                {"acos", 1, acos, 0, false}, {"asin", 1, asin, 0, false},
+                {"atan", 1, atan, 0, false}, {"atan2", 2, 0, atan2, false},
+                {"ceil", 1, ceil, 0, false}, {"cos", 1, cos, 0, false},
+                {"cosh", 1, cosh, 0, true}, {"exp", 1, exp, 0, true},
+                {"fabs", 1, fabs, 0, false}, {"floor", 1, floor, 0, false},
+                {"fmod", 2, 0, fmod, false}, {"hypot", 2, 0, hypot, true},
+                {"log", 1, log, 0, false}, {"log", 2, 0, log_base, false},
+                {"log10", 1, log10, 0, false},
+                {"pow", 2, 0, math_pow, true}, {"sin", 1, sin, 0, false},
+                {"sinh", 1, sinh, 0, true}, {"sqrt", 1, sqrt, 0, false},
+                {"tan", 1, tan, 0, false}, {"tanh", 1, tanh, 0, false},
+                {0, 0, 0, 0, false}
+            };
+            return functions;
+        }
+        static const Function *builtin_functions()
+        {
+            static const Function functions[] = {
+                {"abs", 1, fabs, 0, false}, {"min", 2, 0, builtin_min, false},
+                {"max", 2, 0, builtin_max, false}, {"pow", 2, 0, power, true},
+                {0, 0, 0, 0, false}
+            };
+            return functions;
+        }
+
+        // Value on the simulated stack of the bytecode interpreter
+        struct Item
+        {
+            enum Kind {Value, Module, Callable} kind;
+            bool is_int;
+            const Function *functions;  // for Callable: candidates by name
+            const char *name;
+        };
+
+        void emit(Opcode op, int arg = 0, double value = 0,
+                  const Function *f = 0)
+        {
+            Instruction ins = {op, arg, value, f ? f->f1 : 0, f ? f->f2 : 0,
+                               f ? f->can_overflow : false};
+            program.push_back(ins);
+        }
+
+        // Look up the entry for name with the given number of arguments.
+        static const Function *find(const Function *functions,
+                                    const char *name, int n)
+        {
+            for (; functions->name; ++functions)
+                if (!strcmp(functions->name, name) && functions->nargs == n)
+                    return functions;
+            return 0;
+        }
+
+        // Classify a global or module attribute by identity with the
+        // objects in the math module or the builtins.
+        static bool classify(PyObject *obj, const char *name, Item &item,
+                             Evaluator &self)
+        {
+            Object math(PyImport_ImportModule("math"));
+            if (obj == (PyObject *)math) {
+                Item module = {Item::Module, false, 0, 0};
+                item = module;
+                return true;
+            }
+            PyObject *math_dict = PyModule_GetDict(math);
+            PyObject *in_math = PyDict_GetItemString(math_dict, name);
+            if (in_math && in_math == obj) {
+                if (PyFloat_Check(obj)) {
+                    Item value = {Item::Value, false, 0, 0};
+                    item = value;
+                    self.emit(PushConst, 0, PyFloat_AS_DOUBLE(obj));
+                    return true;
+                }
+                Item callable = {Item::Callable, false, math_functions(), name};
+                item = callable;
+                return find(math_functions(), name, 1) ||
+                    find(math_functions(), name, 2);
+            }
+            PyObject *in_builtins =
+                PyDict_GetItemString(PyEval_GetBuiltins(), name);
+            if (in_builtins && in_builtins == obj &&
+                (find(builtin_functions(), name, 1) ||
+                 find(builtin_functions(), name, 2))) {
+                Item callable = {Item::Callable, false, builtin_functions(), name};
+                item = callable;
+                return true;
+            }
+            return false;
+        }
+
+        bool compile()
+        {
+            if (!PyFunction_Check(func))
+                return false;
+            PyCodeObject *code = (PyCodeObject *)PyFunction_GET_CODE((PyObject *)func);
+            if (code->co_argcount != nargs ||
+                code->co_flags & (CO_VARARGS | CO_VARKEYWORDS | CO_GENERATOR))
+                return false;
+            PyObject *globals = PyFunction_GET_GLOBALS((PyObject *)func);
+            const unsigned char *bytecode =
+                (const unsigned char *)PyString_AS_STRING(code->co_code);
+            Py_ssize_t size = PyString_GET_SIZE(code->co_code);
+            std::vector<Item> stack;
+            Py_ssize_t pc = 0;
+            while (pc < size) {
+                int op = bytecode[pc++];
+                int arg = 0;
+                if (HAS_ARG(op)) {
+                    if (pc + 2 > size)
+                        return false;
+                    arg = bytecode[pc] | bytecode[pc + 1] << 8;
+                    pc += 2;
+                }
+                Item value = {Item::Value, false, 0, 0};
+                switch (op) {
+                case LOAD_FAST:
+                    if (arg >= nargs)
+                        return false;
+                    emit(PushArg, arg);
+                    stack.push_back(value);
+                    break;
+                case LOAD_CONST: {
+                    PyObject *c = PyTuple_GET_ITEM(code->co_consts, arg);
+                    if (PyFloat_Check(c))
+                        emit(PushConst, 0, PyFloat_AS_DOUBLE(c));
+                    else if (PyInt_Check(c)) {
+                        long v = PyInt_AS_LONG(c);
+                        if (v != long(double(v)))
+                            return false;
+                        emit(PushConst, 0, v);
+                        value.is_int = true;
+                    }
+                    else
+                        return false;
+                    stack.push_back(value);
+                    break;
+                }
+                case LOAD_GLOBAL: {
+                    const char *name = PyString_AS_STRING(
+                        PyTuple_GET_ITEM(code->co_names, arg));
+                    PyObject *obj = PyDict_GetItemString(globals, name);
+                    if (!obj)
+                        obj = PyDict_GetItemString(PyEval_GetBuiltins(), name);
+                    if (!obj || !classify(obj, name, value, *this))
+                        return false;
+                    stack.push_back(value);
+                    break;
+                }
+                case LOAD_ATTR: {
+                    if (stack.empty() || stack.back().kind != Item::Module)
+                        return false;
+                    const char *name = PyString_AS_STRING(
+                        PyTuple_GET_ITEM(code->co_names, arg));
+                    Object math(PyImport_ImportModule("math"));
+                    PyObject *obj =
+                        PyDict_GetItemString(PyModule_GetDict(math), name);
+                    if (!obj || !classify(obj, name, value, *this))
+                        return false;
+                    stack.back() = value;
+                    break;
+                }
+                case CALL_FUNCTION: {
+                    int n = arg & 0xff;
+                    if (arg >> 8 || n < 1 || n > 2 ||
+                        int(stack.size()) < n + 1)
+                        return false;
+                    Item &callee = stack[stack.size() - n - 1];
+                    if (callee.kind != Item::Callable)
+                        return false;
+                    for (int i = 1; i <= n; ++i)
+                        if (stack[stack.size() - i].kind != Item::Value)
+                            return false;
+                    const Function *f = find(callee.functions, callee.name, n);
+                    if (!f)
+                        return false;
+                    emit(n == 1 ? Call1 : Call2, 0, 0, f);
+                    stack.resize(stack.size() - n);
+                    stack.back() = value;
+                    break;
+                }
+                case UNARY_POSITIVE:
+                case UNARY_NEGATIVE:
+                    if (stack.empty() || stack.back().kind != Item::Value)
+                        return false;
+                    if (op == UNARY_NEGATIVE)
+                        emit(Negate);
+                    break;
+                case BINARY_ADD:
+                case BINARY_SUBTRACT:
+                case BINARY_MULTIPLY:
+                case BINARY_DIVIDE:
+                case BINARY_TRUE_DIVIDE:
+                case BINARY_FLOOR_DIVIDE:
+                case BINARY_MODULO:
+                case BINARY_POWER:
+                case COMPARE_OP: {
+                    if (stack.size() < 2 ||
+                        stack.back().kind != Item::Value ||
+                        stack[stack.size() - 2].kind != Item::Value)
+                        return false;
+                    bool is_int = stack.back().is_int &&
+                        stack[stack.size() - 2].is_int;
+                    // Integer division would differ from float division.
+                    if (op == BINARY_DIVIDE && is_int)
+                        return false;
+                    if (!emit_binary(op, arg))
+                        return false;
+                    stack.pop_back();
+                    stack.back().is_int = is_int && op != BINARY_TRUE_DIVIDE;
+                    break;
+                }
+                case RETURN_VALUE:
+                    if (pc != size || stack.size() != 1 ||
+                        stack.back().kind != Item::Value)
+                        return false;
+                    return true;
+                default:
+                    return false;
+                }
+                if (int(stack.size()) > depth)
+                    depth = stack.size();
+                if (depth > max_depth)
+                    return false;
+            }
+            return false;
+        }
+
+        bool emit_binary(int op, int arg)
+        {
+            switch (op) {
+            case BINARY_ADD:
+                emit(Add);
+                return true;
+            case BINARY_SUBTRACT:
+                emit(Subtract);
+                return true;
+            case BINARY_MULTIPLY:
+                emit(Multiply);
+                return true;
+            case BINARY_DIVIDE:
+            case BINARY_TRUE_DIVIDE:
+                emit(Divide);
+                return true;
+            case BINARY_FLOOR_DIVIDE:
+                emit(FloorDivide);
+                return true;
+            case BINARY_MODULO:
+                emit(Modulo);
+                return true;
+            case BINARY_POWER:
+                emit(Power);
+                return true;
+            }
+            switch (arg) {
+            case PyCmp_LT:
+                emit(Less);
+                return true;
+            case PyCmp_LE:
+                emit(LessEqual);
+                return true;
+            case PyCmp_EQ:
+                emit(Equal);
+                return true;
+            case PyCmp_NE:
+                emit(NotEqual);
+                return true;
+            case PyCmp_GT:
+                emit(Greater);
+                return true;
+            case PyCmp_GE:
+                emit(GreaterEqual);
+                return true;
+            }
+            return false;
+        }
+
+        Object func;
+        int nargs;
+        bool native_;
+        int depth;
+        std::vector<Instruction> program;
+    };
+}
+
+#endif
@@ -177,12 +177,12 @@ namespace Capy
             : StandardError(msg_, pyexc_) {}
     };
 
-    template <PyCFunction f>
-    static PyObject *
-    check_call(PyObject *self, PyObject *args)
+    // Set the Python exception corresponding to the C++ exception
+    // currently being handled.  Must be called from a catch block.
+    inline void translate_exception()
     {
         try {
-            return f(self, args);
+            throw;
         }
         catch (ExceptionInPythonAPI &e) {}
         catch (Exception &e) {
@@ -197,6 +197,63 @@ namespace Capy
         catch (...) {
             RuntimeError("Unknown C++ exception occurred").raise();
         }
+    }
+
+    // Prepend prefix to the message of the current Python exception,
+    // e.g. to tell which item of a sequence caused it.
+    inline void prefix_error(const std::string &prefix)
+    {
+        PyObject *type, *value, *traceback;
+        PyErr_Fetch(&type, &value, &traceback);
+        PyErr_NormalizeException(&type, &value, &traceback);
+        PyObject *msg = value ? PyObject_Str(value) : 0;
+        if (!msg) {
+            PyErr_Restore(type, value, traceback);
+            return;
+        }
+        PyErr_Format(type, "%s: %s", prefix.c_str(), PyString_AsString(msg));
+        Py_DECREF(msg);
+        Py_DECREF(type);
+        Py_XDECREF(value);
+        Py_XDECREF(traceback);
+    }
+
+    template <PyCFunction f>
+    static PyObject *
+    check_call(PyObject *self, PyObject *args)
+    {
+#ifdef CAPY_REFCOUNT_DIAGNOSTICS
+        RefcountScope scope((void *)check_call<f>);
+#endif
+#ifdef CAPY_DEFERRED_DECREF
+        release_deferred();
+#endif
+        try {
+            return f(self, args);
+        }
+        catch (...) {
+            translate_exception();
+        }
+        return 0;
+    }
+
+    // Variant of check_call() for functions taking keyword arguments
+    template <PyCFunctionWithKeywords f>
+    static PyObject *
+    check_call_kw(PyObject *self, PyObject *args, PyObject *kwargs)
+    {
+#ifdef CAPY_REFCOUNT_DIAGNOSTICS
+        RefcountScope scope((void *)check_call_kw<f>);
+#endif
+#ifdef CAPY_DEFERRED_DECREF
+        release_deferred();
+#endif
+        try {
+            return f(self, args, kwargs);
+        }
+        catch (...) {
+            translate_exception();
+        }
         return 0;
     }
 }
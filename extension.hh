@@ -3,6 +3,12 @@
 
 namespace Capy
 {
+    // Defined in ufunc.hh
+    template <typename RT, typename T, RT (*func)(T)>
+    struct UnaryUFunc;
+    template <typename RT, typename T1, typename T2, RT (*func)(T1, T2)>
+    struct BinaryUFunc;
+
     class Extension
     {
     public:
@@ -11,30 +17,63 @@ namespace Capy
         Extension(const char *mod_name_, const char *mod_doc_ = 0)
             : mod_name(mod_name_),
               mod_doc(mod_doc_),
-              functions(new std::vector<PyMethodDef>)
-        {
-            PyMethodDef func = {0};
-            functions->push_back(func);
-        }
+              functions(new std::vector<PyMethodDef>),
+              static_functions(0),
+              names(new std::deque<std::string>)
+        {}
 
         ~Extension()
         {
             if (PyErr_Occurred())
                 return;
-            PyObject *module =
-                Py_InitModule3(mod_name, &functions->front(), mod_doc);
+            PyMethodDef *table = static_functions;
+            if (!table || !functions->empty()) {
+                if (table) {
+                    PyMethodDef *end = table;
+                    while (end->ml_name)
+                        ++end;
+                    functions->insert(functions->begin(), table, end);
+                }
+                PyMethodDef func = {0};
+                functions->push_back(func);
+                table = &functions->front();
+            }
+#ifdef CAPY_REFCOUNT_DIAGNOSTICS
+            refcount_register_methods(table, 0);
+            refcount_register_methods(builtin_functions(), 0);
+#endif
+            PyObject *module = Py_InitModule3(mod_name, table, mod_doc);
             if (!module)
                 return;
+            // The built-in functions are added separately, so a static
+            // table can still be used in place.
+            PyObject *name = PyString_FromString(mod_name);
+            if (!name)
+                return;
+            for (PyMethodDef *def = builtin_functions(); def->ml_name; ++def) {
+                PyObject *func = PyCFunction_NewEx(def, 0, name);
+                if (!func ||
+                    PyModule_AddObject(module, def->ml_name, func) == -1) {
+                    Py_DECREF(name);
+                    return;
+                }
+            }
+            Py_DECREF(name);
             for (unsigned i = 0; i < objects.size(); ++i)
                 if (PyModule_AddObject(module, obj_names[i],
                                        objects[i].new_reference()) == -1)
                     return;
         }
 
+        // Pure functions returning a value can be memoized by passing
+        // Memoize(capacity), see memo.hh.
         template <typename RT, RT (*func)()>
-        void add_function(const char *name, const char *doc = 0)
+        void add_function(const char *name, const char *doc = 0,
+                          Memoize memo = Memoize())
         {
-            add_function_def(name, check_call<call_function<RT, func> >, doc);
+            add_function_def(name, memoize<check_call<call_function<RT, func> > >(
+                                 std::string(mod_name) + "." + name, memo),
+                             doc);
         }
         template <void (*func)()>
         void add_function(const char *name, const char *doc = 0)
@@ -42,9 +81,12 @@ namespace Capy
             add_function_def(name, check_call<call_function<func> >, doc);
         }
         template <typename RT, typename T, RT (*func)(T)>
-        void add_function(const char *name, const char *doc = 0)
+        void add_function(const char *name, const char *doc = 0,
+                          Memoize memo = Memoize())
         {
-            add_function_def(name, check_call<call_function<RT, T, func> >, doc);
+            add_function_def(name, memoize<check_call<call_function<RT, T, func> > >(
+                                 std::string(mod_name) + "." + name, memo),
+                             doc);
         }
         template <typename T, void (*func)(T)>
         void add_function(const char *name, const char *doc = 0)
@@ -52,9 +94,12 @@ namespace Capy
             add_function_def(name, check_call<call_function<T, func> >, doc);
         }
         template <typename RT, typename T1, typename T2, RT (*func)(T1, T2)>
-        void add_function(const char *name, const char *doc = 0)
+        void add_function(const char *name, const char *doc = 0,
+                          Memoize memo = Memoize())
         {
-            add_function_def(name, check_call<call_function<RT, T1, T2, func> >, doc);
+            add_function_def(name, memoize<check_call<call_function<RT, T1, T2, func> > >(
+                                 std::string(mod_name) + "." + name, memo),
+                             doc);
         }
         template <typename T1, typename T2, void (*func)(T1, T2)>
         void add_function(const char *name, const char *doc = 0)
@@ -62,6 +107,85 @@ namespace Capy
             add_function_def(name, check_call<call_function<T1, T2, func> >, doc);
         }
 
+        // Function table entries that can be built at compile time, for
+        // use in a static table passed to add_functions().
+        template <typename RT, RT (*func)()>
+        static constexpr PyMethodDef
+        function_def(const char *name, const char *doc = 0)
+        {
+            return {name, check_call<call_function<RT, func> >,
+                    METH_VARARGS, doc};
+        }
+        template <void (*func)()>
+        static constexpr PyMethodDef
+        function_def(const char *name, const char *doc = 0)
+        {
+            return {name, check_call<call_function<func> >,
+                    METH_VARARGS, doc};
+        }
+        template <typename RT, typename T, RT (*func)(T)>
+        static constexpr PyMethodDef
+        function_def(const char *name, const char *doc = 0)
+        {
+            return {name, check_call<call_function<RT, T, func> >,
+                    METH_VARARGS, doc};
+        }
+        template <typename T, void (*func)(T)>
+        static constexpr PyMethodDef
+        function_def(const char *name, const char *doc = 0)
+        {
+            return {name, check_call<call_function<T, func> >,
+                    METH_VARARGS, doc};
+        }
+        template <typename RT, typename T1, typename T2, RT (*func)(T1, T2)>
+        static constexpr PyMethodDef
+        function_def(const char *name, const char *doc = 0)
+        {
+            return {name, check_call<call_function<RT, T1, T2, func> >,
+                    METH_VARARGS, doc};
+        }
+        template <typename T1, typename T2, void (*func)(T1, T2)>
+        static constexpr PyMethodDef
+        function_def(const char *name, const char *doc = 0)
+        {
+            return {name, check_call<call_function<T1, T2, func> >,
+                    METH_VARARGS, doc};
+        }
+
+        // Add a zero-terminated static function table.  If there are no
+        // other functions, the table is used in place; the built-in
+        // _capy_* functions don't count.
+        void add_functions(PyMethodDef *table)
+        {
+            if (!static_functions && functions->empty()) {
+                static_functions = table;
+                return;
+            }
+            for (; table->ml_name; ++table)
+                functions->push_back(*table);
+        }
+
+        // Register a NumPy ufunc with typed inner loops calling func.
+        // Requires ufunc.hh.
+        template <typename RT, typename T, RT (*func)(T)>
+        void add_ufunc(const char *name, const char *doc = 0)
+        {
+            add_object(name, UnaryUFunc<RT, T, func>::create(name, doc));
+        }
+        template <typename RT, typename T1, typename T2, RT (*func)(T1, T2)>
+        void add_ufunc(const char *name, const char *doc = 0)
+        {
+            add_object(name, BinaryUFunc<RT, T1, T2, func>::create(name, doc));
+        }
+
+        // Store a generated name, e.g. of a type or method, for the
+        // lifetime of the module.
+        const char *keep_name(const std::string &name)
+        {
+            names->push_back(name);
+            return names->back().c_str();
+        }
+
         void add_object(const char *name, Object obj)
         {
             obj_names.push_back(name);
@@ -69,11 +193,31 @@ namespace Capy
         }
 
     private:
+        static PyMethodDef *builtin_functions()
+        {
+            static PyMethodDef table[] = {
+                {"_capy_memory_summary", memory_summary_function, METH_VARARGS,
+                 "Live instances and bytes per wrapped type."},
+                {"_capy_memo_stats", memo_stats_function, METH_VARARGS,
+                 "Hits, misses, entries and capacity per memoized function."},
+                {"_capy_memo_clear", memo_clear_function, METH_VARARGS,
+                 "Clear the memoized results of an object, or all results "
+                 "and counts."},
+#ifdef CAPY_REFCOUNT_DIAGNOSTICS
+                {"_capy_refcount_stats", refcount_stats_function, METH_VARARGS,
+                 "Reference counting statistics per source location and per "
+                 "wrapped function."},
+#endif
+                {0}
+            };
+            return table;
+        }
+
         void add_function_def(const char *name, PyCFunction func,
                               const char *doc)
         {
             PyMethodDef def = {name, func, METH_VARARGS, doc};
-            functions->insert(functions->end() - 1, def);
+            functions->push_back(def);
         }
 
         template <typename RT, RT (*func)()>
@@ -82,7 +226,7 @@ namespace Capy
         {
             if (!PyArg_ParseTuple(args, ""))
                 return 0;
-            return Object(func()).new_reference();
+            return ReturnConverter<RT>::convert(func());
         }
         template <void (*func)()>
         static PyObject *
@@ -100,7 +244,8 @@ namespace Capy
             PyObject *py_arg1;
             if (!PyArg_ParseTuple(args, "O", &py_arg1))
                 return 0;
-            return Object(func(Object(py_arg1).new_reference())).new_reference();
+            return ReturnConverter<RT>::convert(
+                func(ArgConverter<T>::convert(py_arg1)));
         }
         template <typename T, void (*func)(T)>
         static PyObject *
@@ -109,7 +254,7 @@ namespace Capy
             PyObject *py_arg1;
             if (!PyArg_ParseTuple(args, "O", &py_arg1))
                 return 0;
-            func(Object(py_arg1).new_reference());
+            func(ArgConverter<T>::convert(py_arg1));
             Py_RETURN_NONE;
         }
         template <typename RT, typename T1, typename T2, RT (*func)(T1, T2)>
@@ -120,8 +265,9 @@ namespace Capy
             PyObject *py_arg2;
             if (!PyArg_ParseTuple(args, "OO", &py_arg1, &py_arg2))
                 return 0;
-            return Object(func(Object(py_arg1).new_reference(),
-                               Object(py_arg2).new_reference())).new_reference();
+            return ReturnConverter<RT>::convert(
+                func(ArgConverter<T1>::convert(py_arg1),
+                     ArgConverter<T2>::convert(py_arg2)));
         }
         template <typename T1, typename T2, void (*func)(T1, T2)>
         static PyObject *
@@ -131,12 +277,15 @@ namespace Capy
             PyObject *py_arg2;
             if (!PyArg_ParseTuple(args, "OO", &py_arg1, &py_arg2))
                 return 0;
-            func(Object(py_arg1).new_reference(), Object(py_arg2).new_reference());
+            func(ArgConverter<T1>::convert(py_arg1),
+                 ArgConverter<T2>::convert(py_arg2));
             Py_RETURN_NONE;
         }
 
         const char *mod_doc;
         std::vector<PyMethodDef> *functions;
+        PyMethodDef *static_functions;
+        std::deque<std::string> *names;
         std::vector<const char *> obj_names;
         std::vector<Object> objects;
     };
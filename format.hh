@@ -0,0 +1,105 @@
+#ifndef CAPY_FORMAT_HH
+#define CAPY_FORMAT_HH
+
+#include "output.hh"
+#include "parallel.hh"
+
+#include <charconv>
+#include <string>
+
+// This header contains a fast formatter for column-based text output.
+
+namespace Capy
+{
+    // Layout of a line of text output, consisting of literal text and
+    // numeric columns.  A column is formatted exactly like a
+    // std::ostream with std::setw(width) and the given precision in the
+    // default float format would do it, i.e. like printf("%*.*g"), but
+    // without the overhead of iostreams and locales.
+    class TextFormat
+    {
+    public:
+        TextFormat()
+            : ncolumns(0)
+        {}
+        TextFormat &literal(std::string_view text)
+        {
+            Field field = {std::string(text), -1, 0, 0};
+            fields.push_back(field);
+            return *this;
+        }
+        TextFormat &column(int width = 0, int precision = 6)
+        {
+            Field field = {std::string(), int(ncolumns++), width, precision};
+            fields.push_back(field);
+            return *this;
+        }
+        size_t columns() const
+        {
+            return ncolumns;
+        }
+
+        // Append the formatted line for the given row to out.  columns
+        // points to one array per column.
+        void format_row(std::string &out, const double *const *columns,
+                        size_t row) const
+        {
+            char buf[64];
+            for (size_t i = 0; i < fields.size(); ++i) {
+                const Field &field = fields[i];
+                if (field.column < 0) {
+                    out += field.text;
+                    continue;
+                }
+                char *end = std::to_chars(
+                    buf, buf + sizeof(buf), columns[field.column][row],
+                    std::chars_format::general, field.precision).ptr;
+                int size = end - buf;
+                if (size < field.width)
+                    out.append(field.width - size, ' ');
+                out.append(buf, size);
+            }
+        }
+
+    private:
+        struct Field
+        {
+            std::string text;
+            int column;
+            int width;
+            int precision;
+        };
+        std::vector<Field> fields;
+        size_t ncolumns;
+    };
+
+    // Write rows lines formatted according to format to the given file.
+    // The rows are split into chunks that are formatted in parallel with
+    // the GIL released; the formatted chunks are then written in large
+    // blocks.
+    inline void write_text(const char *filename, const TextFormat &format,
+                           const double *const *columns, size_t rows)
+    {
+        const size_t chunk_rows = 1 << 14;
+        const size_t batch_chunks = 4 * num_threads();
+        OutputFile file(filename);
+        std::vector<std::string> chunks(batch_chunks);
+        for (size_t first = 0; first < rows; first += chunk_rows * batch_chunks) {
+            size_t nchunks = std::min(batch_chunks,
+                                      (rows - first + chunk_rows - 1) / chunk_rows);
+            parallel_for(nchunks, [&](size_t i) {
+                size_t begin = first + i * chunk_rows;
+                size_t end = std::min(begin + chunk_rows, rows);
+                std::string &out = chunks[i];
+                out.clear();
+                for (size_t row = begin; row < end; ++row)
+                    format.format_row(out, columns, row);
+            });
+            for (size_t i = 0; i < nchunks; ++i)
+                file.write(chunks[i].data(), chunks[i].size());
+        }
+        file.close();
+    }
+}
+
+#endif
@@ -0,0 +1,185 @@
+#ifndef CAPY_GENERATOR_HH
+#define CAPY_GENERATOR_HH
+
+#include "capy.hh"
+
+// This header contains Generator<T>, the return type of C++20
+// coroutines that co_yield values of type T.  Wrapped functions and
+// methods returning a generator return a Python iterator, which resumes
+// the coroutine in the calling thread on every next() and converts the
+// yielded value.  The coroutine only runs as far as the iterator is
+// consumed.  A method's iterator keeps the instance alive.  Without
+// compiler support for coroutines, this header is empty.
+
+#ifdef __cpp_impl_coroutine
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+namespace Capy
+{
+    template <typename T>
+    class Generator
+    {
+    public:
+        struct promise_type
+        {
+            Generator get_return_object()
+            {
+                return Generator(Handle::from_promise(*this));
+            }
+            std::suspend_always initial_suspend() noexcept
+            {
+                return std::suspend_always();
+            }
+            std::suspend_always final_suspend() noexcept
+            {
+                return std::suspend_always();
+            }
+            template <typename U>
+            std::suspend_always yield_value(U &&v)
+            {
+                value.emplace(std::forward<U>(v));
+                return std::suspend_always();
+            }
+            void return_void()
+            {}
+            void unhandled_exception()
+            {
+                exception = std::current_exception();
+            }
+
+            std::optional<T> value;
+            std::exception_ptr exception;
+        };
+        typedef std::coroutine_handle<promise_type> Handle;
+
+        Generator(Generator &&other)
+            : handle(other.handle)
+        {
+            other.handle = Handle();
+        }
+        Generator(const Generator &) = delete;
+        Generator &operator=(const Generator &) = delete;
+        ~Generator()
+        {
+            if (handle)
+                handle.destroy();
+        }
+
+        // Resume the coroutine and return the next value, or 0 at the
+        // end.  Exceptions escaping the coroutine are rethrown here.
+        T *next()
+        {
+            if (!handle || handle.done())
+                return 0;
+            promise_type &promise = handle.promise();
+            promise.value.reset();
+            handle.resume();
+            if (promise.exception)
+                std::rethrow_exception(std::exchange(promise.exception,
+                                                     std::exception_ptr()));
+            if (handle.done())
+                return 0;
+            return &*promise.value;
+        }
+
+    private:
+        explicit Generator(Handle handle_)
+            : handle(handle_)
+        {}
+
+        Handle handle;
+    };
+
+    // Python iterator over a generator
+    template <typename T>
+    class GeneratorIterator
+    {
+    public:
+        // owner is kept alive as long as the iterator, or may be 0.
+        static PyObject *create(Generator<T> &&generator, PyObject *owner)
+        {
+            PyTypeObject *type = iterator_type();
+            IterObject *self = (IterObject *)check_error(
+                (PyObject *)PyObject_New(IterObject, type));
+            self->generator = 0;
+            Py_XINCREF(owner);
+            self->owner = owner;
+            Object result((PyObject *)self);
+            self->generator = new Generator<T>(std::move(generator));
+            return result.new_reference();
+        }
+
+    private:
+        struct IterObject
+        {
+            PyObject_HEAD
+            Generator<T> *generator;
+            PyObject *owner;
+        };
+
+        static PyTypeObject *iterator_type()
+        {
+            static PyTypeObject type;
+            if (!type.tp_name) {
+                type.tp_name = "capy.Generator";
+                type.tp_basicsize = sizeof(IterObject);
+                type.tp_dealloc = (destructor)dealloc;
+                type.tp_flags = Py_TPFLAGS_DEFAULT;
+                type.tp_doc = "Iterator over the values of a C++ coroutine";
+                type.tp_iter = PyObject_SelfIter;
+                type.tp_iternext = (iternextfunc)next;
+                if (PyType_Ready(&type) == -1) {
+                    type.tp_name = 0;
+                    throw ExceptionInPythonAPI();
+                }
+            }
+            return &type;
+        }
+
+        static PyObject *next(IterObject *self)
+        {
+            try {
+                T *value = self->generator ? self->generator->next() : 0;
+                if (!value) {
+                    // Free the coroutine frame as soon as it's finished.
+                    delete self->generator;
+                    self->generator = 0;
+                    return 0;
+                }
+                return ReturnConverter<T>::convert(*value);
+            }
+            catch (...) {
+                translate_exception();
+                return 0;
+            }
+        }
+
+        static void dealloc(IterObject *self)
+        {
+            delete self->generator;
+            Py_XDECREF(self->owner);
+            PyObject_Del(self);
+        }
+    };
+
+    template <typename T>
+    struct KeepsOwner<Generator<T> > : std::true_type
+    {};
+    template <typename T>
+    struct ReturnConverter<Generator<T> >
+    {
+        static PyObject *convert(Generator<T> &&generator,
+                                 PyObject *owner = 0)
+        {
+            return GeneratorIterator<T>::create(std::move(generator), owner);
+        }
+    };
+}
+
+#endif
+
+#endif
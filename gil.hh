@@ -0,0 +1,102 @@
+#ifndef CAPY_GIL_HH
+#define CAPY_GIL_HH
+
+#include <pythread.h>
+
+#include <atomic>
+#include <cassert>
+
+// This header contains the handling of references dropped by threads
+// that don't hold the GIL.  By default, destroying an Object without
+// the GIL is an error, which is caught by an assertion in debug builds.
+// If CAPY_DEFERRED_DECREF is defined, such references are pushed onto a
+// lock-free queue instead and released in a batch the next time the
+// GIL is held, either from a pending call scheduled by the first
+// deferred reference or on entry of the next wrapped function.
+
+namespace Capy
+{
+    // Whether the calling thread holds the GIL
+    inline bool gil_held()
+    {
+#if PY_VERSION_HEX >= 0x03040000
+        return PyGILState_Check();
+#else
+        PyThreadState *state = _PyThreadState_Current;
+        return state && state->thread_id == PyThread_get_thread_ident();
+#endif
+    }
+
+#ifdef CAPY_DEFERRED_DECREF
+    struct DeferredDecref
+    {
+        PyObject *obj;
+        DeferredDecref *next;
+    };
+
+    inline std::atomic<DeferredDecref *> &deferred_decrefs()
+    {
+        static std::atomic<DeferredDecref *> head(0);
+        return head;
+    }
+
+    // Release all deferred references.  Must be called with the GIL.
+    inline void release_deferred()
+    {
+        DeferredDecref *node = deferred_decrefs().exchange(0);
+        while (node) {
+            DeferredDecref *next = node->next;
+            Py_DECREF(node->obj);
+            delete node;
+            node = next;
+        }
+    }
+
+    inline int release_deferred_pending(void *)
+    {
+        release_deferred();
+        return 0;
+    }
+
+    // Queue obj for release.  Only the push that finds the queue empty
+    // schedules a pending call; if the interpreter's pending call queue
+    // is full, the references wait for the next wrapped function.
+    inline void defer_decref(PyObject *obj)
+    {
+        DeferredDecref *node = new DeferredDecref;
+        node->obj = obj;
+        std::atomic<DeferredDecref *> &head = deferred_decrefs();
+        node->next = head.load(std::memory_order_relaxed);
+        while (!head.compare_exchange_weak(node->next, node,
+                                           std::memory_order_release,
+                                           std::memory_order_relaxed))
+            ;
+        if (!node->next)
+            Py_AddPendingCall(release_deferred_pending, 0);
+    }
+#endif
+
+    // Take a new reference for an Object.  Unlike dropping one, this
+    // can't be deferred, so the GIL is required.
+    inline void incref(PyObject *obj)
+    {
+        assert(gil_held());
+        Py_INCREF(obj);
+    }
+
+    // Drop a reference owned by an Object
+    inline void decref(PyObject *obj)
+    {
+#ifdef CAPY_DEFERRED_DECREF
+        if (!gil_held()) {
+            defer_decref(obj);
+            return;
+        }
+#else
+        assert(gil_held());
+#endif
+        Py_DECREF(obj);
+    }
+}
+
+#endif
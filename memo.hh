@@ -0,0 +1,258 @@
+#ifndef CAPY_MEMO_HH
+#define CAPY_MEMO_HH
+
+#include <list>
+
+// This header contains the memoization of pure wrapped functions and
+// methods, enabled by passing Memoize(capacity) to add_function() or
+// add_method().  Results are cached in a bounded LRU cache per function,
+// keyed by the instance and the argument tuple, which must be hashable;
+// calls with unhashable arguments, like arrays, are not cached.  Errors
+// aren't cached, and the cached objects are returned as they are, so
+// this is meant for results that aren't modified, like numbers.  Entries
+// of an instance are dropped when it is deallocated, or by calling
+// invalidate_memo() when its state changes.  The module functions
+// _capy_memo_stats() and _capy_memo_clear() report hits and misses and
+// clear the caches.
+
+namespace Capy
+{
+    // Registration option for pure functions and methods
+    struct Memoize
+    {
+        explicit Memoize(size_t capacity_ = 0)
+            : capacity(capacity_)
+        {}
+        size_t capacity;
+    };
+
+    class MemoCache
+    {
+    public:
+        MemoCache(const std::string &name_, size_t capacity_)
+            : name(name_), capacity(capacity_), hits(0), misses(0)
+        {}
+
+        PyObject *call(PyCFunction thunk, PyObject *self, PyObject *args)
+        {
+            long hash = PyObject_Hash(args);
+            if (hash == -1) {
+                PyErr_Clear();
+                ++misses;
+                return thunk(self, args);
+            }
+            size_t key = size_t(hash) ^ std::hash<void *>()(self);
+            // Comparing the arguments may call back into the cache and
+            // drop or move entries, so the candidates are copied first.
+            std::vector<std::pair<Object, Object> > candidates;
+            std::pair<Index::iterator, Index::iterator> range =
+                index.equal_range(key);
+            for (Index::iterator it = range.first; it != range.second; ++it)
+                if (it->second->self == self)
+                    candidates.push_back(std::make_pair(
+                        Object(it->second->args).new_reference(),
+                        Object(it->second->value).new_reference()));
+            for (size_t i = 0; i < candidates.size(); ++i) {
+                int equal = PyObject_RichCompareBool(candidates[i].first, args,
+                                                     Py_EQ);
+                if (equal == -1)
+                    return 0;
+                if (equal) {
+                    ++hits;
+                    touch(key, self, candidates[i].first);
+                    return candidates[i].second.new_reference();
+                }
+            }
+            ++misses;
+            Object value(thunk(self, args));
+            Entry entry = {self, args, value, key};
+            entries.push_front(entry);
+            Index::iterator indexed = index.end();
+            try {
+                indexed = index.insert(std::make_pair(key, entries.begin()));
+                ++owners[self];
+            }
+            catch (...) {
+                if (indexed != index.end())
+                    index.erase(indexed);
+                entries.pop_front();
+                throw;
+            }
+            Py_INCREF(args);
+            Py_INCREF(value);
+            Entries evicted;
+            while (entries.size() > capacity)
+                remove(--entries.end(), evicted);
+            release(evicted);
+            return value.new_reference();
+        }
+
+        // Drop the entries of self, or all entries if all is set.
+        void invalidate(PyObject *self, bool all = false)
+        {
+            if (!all && !owners.count(self))
+                return;
+            Entries removed;
+            for (Entries::iterator it = entries.begin(); it != entries.end();) {
+                Entries::iterator entry = it++;
+                if (all || entry->self == self)
+                    remove(entry, removed);
+            }
+            release(removed);
+        }
+
+        size_t size() const
+        {
+            return entries.size();
+        }
+
+        std::string name;
+        size_t capacity;
+        unsigned long hits;
+        unsigned long misses;
+
+    private:
+        struct Entry
+        {
+            PyObject *self;
+            PyObject *args;
+            PyObject *value;
+            size_t key;
+        };
+        typedef std::list<Entry> Entries;
+        typedef std::unordered_multimap<size_t, Entries::iterator> Index;
+
+        // Mark the entry of self with the given arguments, if it's still
+        // there, as most recently used.
+        void touch(size_t key, PyObject *self, PyObject *args)
+        {
+            std::pair<Index::iterator, Index::iterator> range =
+                index.equal_range(key);
+            for (Index::iterator it = range.first; it != range.second; ++it)
+                if (it->second->self == self && it->second->args == args) {
+                    entries.splice(entries.begin(), entries, it->second);
+                    return;
+                }
+        }
+
+        // Move entry to removed.  Its references are released only after
+        // the cache is consistent again, since that may call back into it.
+        void remove(Entries::iterator entry, Entries &removed)
+        {
+            std::pair<Index::iterator, Index::iterator> range =
+                index.equal_range(entry->key);
+            for (Index::iterator it = range.first; it != range.second; ++it)
+                if (it->second == entry) {
+                    index.erase(it);
+                    break;
+                }
+            if (!--owners[entry->self])
+                owners.erase(entry->self);
+            removed.splice(removed.end(), entries, entry);
+        }
+        static void release(Entries &removed)
+        {
+            for (Entries::iterator it = removed.begin(); it != removed.end();
+                 ++it) {
+                Py_DECREF(it->args);
+                Py_DECREF(it->value);
+            }
+        }
+
+        // Most recently used first
+        Entries entries;
+        Index index;
+        // Number of entries per instance
+        std::unordered_map<PyObject *, size_t> owners;
+    };
+
+    inline std::vector<MemoCache *> &memo_caches()
+    {
+        static std::vector<MemoCache *> *caches = new std::vector<MemoCache *>;
+        return *caches;
+    }
+
+    // Drop the cached results of methods of self, e.g. after changing its
+    // state.
+    inline void invalidate_memo(PyObject *self)
+    {
+        std::vector<MemoCache *> &caches = memo_caches();
+        for (size_t i = 0; i < caches.size(); ++i)
+            caches[i]->invalidate(self);
+    }
+
+    template <PyCFunction thunk>
+    MemoCache *&memo_cache()
+    {
+        static MemoCache *cache = 0;
+        return cache;
+    }
+
+    // Called through check_call(), since the cache may throw bad_alloc.
+    template <PyCFunction thunk>
+    PyObject *memoized(PyObject *self, PyObject *args)
+    {
+        return memo_cache<thunk>()->call(thunk, self, args);
+    }
+
+    // Set up the cache of thunk and return the memoized function.
+    template <PyCFunction thunk>
+    PyCFunction memoize(const std::string &name, Memoize memo)
+    {
+        if (!memo.capacity)
+            return thunk;
+        MemoCache *&cache = memo_cache<thunk>();
+        if (!cache) {
+            cache = new MemoCache(name, memo.capacity);
+            memo_caches().push_back(cache);
+        }
+        cache->capacity = memo.capacity;
+#ifdef CAPY_REFCOUNT_DIAGNOSTICS
+        refcount_method_names()[(void *)check_call<memoized<thunk> >] = name;
+#endif
+        return check_call<memoized<thunk> >;
+    }
+
+    // _capy_memo_stats() returns a dictionary mapping the names of the
+    // memoized functions to (hits, misses, entries, capacity).
+    inline PyObject *memo_stats_function(PyObject *, PyObject *args)
+    {
+        if (!PyArg_ParseTuple(args, ""))
+            return 0;
+        PyObject *stats = PyDict_New();
+        if (!stats)
+            return 0;
+        std::vector<MemoCache *> &caches = memo_caches();
+        for (size_t i = 0; i < caches.size(); ++i) {
+            PyObject *value = Py_BuildValue(
+                "(kknn)", caches[i]->hits, caches[i]->misses,
+                Py_ssize_t(caches[i]->size()), Py_ssize_t(caches[i]->capacity));
+            if (!value || PyDict_SetItemString(stats, caches[i]->name.c_str(),
+                                               value) == -1) {
+                Py_XDECREF(value);
+                Py_DECREF(stats);
+                return 0;
+            }
+            Py_DECREF(value);
+        }
+        return stats;
+    }
+
+    // _capy_memo_clear(obj=None) drops the cached results of obj's
+    // methods, or all cached results and counts.
+    inline PyObject *memo_clear_function(PyObject *, PyObject *args)
+    {
+        PyObject *self = Py_None;
+        if (!PyArg_ParseTuple(args, "|O", &self))
+            return 0;
+        std::vector<MemoCache *> &caches = memo_caches();
+        for (size_t i = 0; i < caches.size(); ++i) {
+            caches[i]->invalidate(self, self == Py_None);
+            if (self == Py_None)
+                caches[i]->hits = caches[i]->misses = 0;
+        }
+        Py_RETURN_NONE;
+    }
+}
+
+#endif
@@ -0,0 +1,123 @@
+#ifndef CAPY_MEMORY_HH
+#define CAPY_MEMORY_HH
+
+// This header contains the memory accounting of wrapped instances and
+// the reference-counted storage shared with NumPy views.  The module
+// function _capy_memory_summary() returns the number of live instances
+// and their size per wrapped type.
+
+#include <stdlib.h>
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+
+namespace Capy
+{
+    // Header of a block allocated by SharedAllocator, counting the
+    // vector owning it and the NumPy views of it
+    struct alignas(std::max_align_t) SharedBlock
+    {
+        std::atomic<long> refs;
+    };
+
+    inline void *shared_block_allocate(size_t bytes)
+    {
+        void *memory = malloc(sizeof(SharedBlock) + bytes);
+        if (!memory)
+            throw std::bad_alloc();
+        SharedBlock *block = new (memory) SharedBlock;
+        block->refs.store(1, std::memory_order_relaxed);
+        return block + 1;
+    }
+    inline void shared_block_acquire(const void *data)
+    {
+        ((SharedBlock *)data - 1)->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    inline void shared_block_release(const void *data)
+    {
+        SharedBlock *block = (SharedBlock *)data - 1;
+        if (block->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            block->~SharedBlock();
+            free(block);
+        }
+    }
+
+    // Allocator of reference-counted blocks.  A block given back by the
+    // vector, e.g. when it grows, is only freed once the NumPy views of
+    // it are gone, see Class::add_array_member().
+    template <typename T>
+    struct SharedAllocator
+    {
+        typedef T value_type;
+
+        SharedAllocator()
+        {}
+        template <typename U>
+        SharedAllocator(const SharedAllocator<U> &)
+        {}
+        T *allocate(size_t n)
+        {
+            return (T *)shared_block_allocate(n * sizeof(T));
+        }
+        void deallocate(T *p, size_t)
+        {
+            shared_block_release(p);
+        }
+        template <typename U>
+        bool operator==(const SharedAllocator<U> &) const
+        {
+            return true;
+        }
+        template <typename U>
+        bool operator!=(const SharedAllocator<U> &) const
+        {
+            return false;
+        }
+    };
+
+    template <typename T>
+    using SharedVector = std::vector<T, SharedAllocator<T> >;
+
+    // Wrapped types with a function adding up their live instances
+    struct TypeMemory
+    {
+        const char *name;
+        void (*summary)(size_t *instances, size_t *bytes);
+    };
+    inline std::vector<TypeMemory> &memory_types()
+    {
+        static std::vector<TypeMemory> *types = new std::vector<TypeMemory>;
+        return *types;
+    }
+
+    // _capy_memory_summary() returns a dictionary mapping the names of
+    // the wrapped types to (live instances, bytes), and "capy.aligned"
+    // to the blocks of arrays created by Array::aligned().
+    inline PyObject *memory_summary_function(PyObject *, PyObject *args)
+    {
+        if (!PyArg_ParseTuple(args, ""))
+            return 0;
+        PyObject *summary = PyDict_New();
+        if (!summary)
+            return 0;
+        std::vector<TypeMemory> &types = memory_types();
+        for (size_t i = 0; i < types.size(); ++i) {
+            size_t instances = 0;
+            size_t bytes = 0;
+            types[i].summary(&instances, &bytes);
+            PyObject *value = Py_BuildValue("(nn)", Py_ssize_t(instances),
+                                            Py_ssize_t(bytes));
+            if (!value ||
+                PyDict_SetItemString(summary, types[i].name, value) == -1) {
+                Py_XDECREF(value);
+                Py_DECREF(summary);
+                return 0;
+            }
+            Py_DECREF(value);
+        }
+        return summary;
+    }
+}
+
+#endif
@@ -0,0 +1,432 @@
+#ifndef CAPY_OUTPUT_HH
+#define CAPY_OUTPUT_HH
+
+#include "array.hh"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// This header contains a buffered writer for binary output files and
+// functions to store arrays and C++ ranges in NumPy's .npy format.
+
+namespace Capy
+{
+    // Binary output file.  Data is collected in a large buffer and
+    // handed to the operating system in big blocks.  If background is
+    // set, full buffers are written by a separate thread, so the caller
+    // can continue to fill the next buffer in the meantime.  Errors
+    // are raised as Python IOError.
+    class OutputFile
+    {
+    public:
+        explicit OutputFile(const char *filename_,
+                            size_t buffer_size = 1 << 22,
+                            bool background = false)
+            : filename(filename_),
+              buffer(buffer_size),
+              used(0),
+              position(0),
+              pending(0),
+              error(0),
+              stop(false),
+              writer(0)
+        {
+            fd = ::open(filename_, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (fd == -1)
+                raise(errno);
+            if (background) {
+                back_buffer.resize(buffer_size);
+                writer = new std::thread(&OutputFile::run, this);
+            }
+        }
+
+        ~OutputFile()
+        {
+            finish();
+        }
+
+        void write(const void *data, size_t size)
+        {
+            if (used + size > buffer.size()) {
+                flush();
+                if (size >= buffer.size()) {
+                    sync();
+                    write_block((const char *)data, size);
+                    position += size;
+                    return;
+                }
+            }
+            memcpy(&buffer[used], data, size);
+            used += size;
+            position += size;
+        }
+        template <typename T>
+        void write(const T &value)
+        {
+            write(&value, sizeof(T));
+        }
+
+        // Hand the current buffer over to the operating system (or the
+        // background thread).
+        void flush()
+        {
+            if (!used)
+                return;
+            if (writer) {
+                wait();
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    buffer.swap(back_buffer);
+                    pending = used;
+                }
+                cond.notify_all();
+            }
+            else
+                write_block(&buffer[0], used);
+            used = 0;
+        }
+
+        // Flush and wait until all data has been written.
+        void sync()
+        {
+            flush();
+            if (writer)
+                wait();
+        }
+
+        // Overwrite already written data at the given file offset.
+        void write_at(off_t offset, const void *data, size_t size)
+        {
+            sync();
+            const char *p = (const char *)data;
+            int err = 0;
+            {
+                AllowThreads allow;
+                while (size) {
+                    ssize_t n = ::pwrite(fd, p, size, offset);
+                    if (n == -1) {
+                        if (errno == EINTR)
+                            continue;
+                        err = errno;
+                        break;
+                    }
+                    p += n;
+                    offset += n;
+                    size -= n;
+                }
+            }
+            if (err)
+                raise(err);
+        }
+
+        off_t tell() const
+        {
+            return position;
+        }
+
+        void close()
+        {
+            int err = finish();
+            if (err)
+                raise(err);
+        }
+
+    private:
+        OutputFile(const OutputFile &);
+        OutputFile &operator=(const OutputFile &);
+
+        static int write_all(int fd, const char *p, size_t size)
+        {
+            while (size) {
+                ssize_t n = ::write(fd, p, size);
+                if (n == -1) {
+                    if (errno == EINTR)
+                        continue;
+                    return errno;
+                }
+                p += n;
+                size -= n;
+            }
+            return 0;
+        }
+
+        void write_block(const char *p, size_t size)
+        {
+            int err;
+            {
+                AllowThreads allow;
+                err = write_all(fd, p, size);
+            }
+            if (err)
+                raise(err);
+        }
+
+        // Wait for the background thread to finish the pending block.
+        void wait()
+        {
+            int err;
+            {
+                AllowThreads allow;
+                std::unique_lock<std::mutex> lock(mutex);
+                while (pending)
+                    cond.wait(lock);
+                err = error;
+                error = 0;
+            }
+            if (err)
+                raise(err);
+        }
+
+        void run()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            for (;;) {
+                while (!pending && !stop)
+                    cond.wait(lock);
+                if (!pending)
+                    return;
+                size_t size = pending;
+                lock.unlock();
+                int err = write_all(fd, &back_buffer[0], size);
+                lock.lock();
+                if (err && !error)
+                    error = err;
+                pending = 0;
+                cond.notify_all();
+            }
+        }
+
+        // Write all remaining data and close the file without raising
+        // exceptions.  Returns an errno value or 0.
+        int finish()
+        {
+            if (fd == -1)
+                return 0;
+            AllowThreads allow;
+            int err = 0;
+            if (writer) {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    while (pending)
+                        cond.wait(lock);
+                    err = error;
+                    if (used && !err) {
+                        buffer.swap(back_buffer);
+                        pending = used;
+                    }
+                    stop = true;
+                }
+                cond.notify_all();
+                writer->join();
+                delete writer;
+                writer = 0;
+                if (!err)
+                    err = error;
+            }
+            else if (used)
+                err = write_all(fd, &buffer[0], used);
+            used = 0;
+            if (::close(fd) == -1 && !err)
+                err = errno;
+            fd = -1;
+            return err;
+        }
+
+        void raise(int err)
+        {
+            errno = err;
+            PyErr_SetFromErrnoWithFilename(PyExc_IOError,
+                                           const_cast<char *>(filename.c_str()));
+            throw ExceptionInPythonAPI();
+        }
+
+        std::string filename;
+        int fd;
+        std::vector<char> buffer;
+        size_t used;
+        off_t position;
+        std::vector<char> back_buffer;
+        size_t pending;
+        int error;
+        bool stop;
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::thread *writer;
+    };
+
+    // Type description of a NumPy dtype in the notation used by the
+    // .npy format, e.g. "<f8".
+    inline std::string npy_descr(PyArray_Descr *descr)
+    {
+        if (PyDataType_HASFIELDS(descr))
+            throw ValueError("structured dtypes are not supported");
+        char byteorder = descr->byteorder;
+        if (byteorder == '=')
+            byteorder = NPY_NATBYTE;
+        char result[32];
+        snprintf(result, sizeof(result), "%c%c%d",
+                 byteorder, descr->kind, descr->elsize);
+        return result;
+    }
+    template <typename T>
+    inline std::string npy_descr()
+    {
+        PyArray_Descr *descr = PyArray_DescrFromType(NumpyTypeCode<T>::value);
+        check_error((PyObject *)descr);
+        std::string result = npy_descr(descr);
+        Py_DECREF(descr);
+        return result;
+    }
+
+    // Header of a version 1.0 .npy file, padded with spaces to at least
+    // min_size bytes.  The total size is always a multiple of 64.
+    inline std::string npy_header(const std::string &descr, int nd,
+                                  const npy_intp *dims, size_t min_size = 0)
+    {
+        std::string dict = "{'descr': '" + descr +
+            "', 'fortran_order': False, 'shape': (";
+        char number[32];
+        for (int i = 0; i < nd; ++i) {
+            snprintf(number, sizeof(number), i ? ", %ld" : "%ld",
+                     (long)dims[i]);
+            dict += number;
+        }
+        if (nd == 1)
+            dict += ",";
+        dict += "), }";
+        size_t size = 10 + dict.size() + 1;
+        if (size < min_size)
+            size = min_size;
+        size = (size + 63) / 64 * 64;
+        dict.resize(size - 11, ' ');
+        dict += '\n';
+        std::string header("\x93NUMPY\x01\x00", 8);
+        header += char((size - 10) & 0xff);
+        header += char((size - 10) >> 8);
+        return header + dict;
+    }
+
+    // Streaming writer for .npy files.  Elements are appended in
+    // arbitrary chunks; the shape in the header is filled in when the
+    // file is closed.  If columns is nonzero, the result is a
+    // two-dimensional array with the given number of columns.
+    template <typename T>
+    class NpyWriter
+    {
+    public:
+        explicit NpyWriter(const char *filename, npy_intp columns_ = 0,
+                           bool background = false)
+            : file(filename, 1 << 22, background),
+              descr(npy_descr<T>()),
+              columns(columns_),
+              count(0)
+        {
+            file.write(header().data(), header_size);
+        }
+
+        ~NpyWriter()
+        {
+            if (!closed()) {
+                try {
+                    close();
+                }
+                catch (ExceptionInPythonAPI &) {
+                    PyErr_Clear();
+                }
+                catch (...) {}
+            }
+        }
+
+        void write(const T &value)
+        {
+            file.write(&value, sizeof(T));
+            ++count;
+        }
+        void write(const T *data, size_t n)
+        {
+            file.write(data, n * sizeof(T));
+            count += n;
+        }
+        template <typename Iterator>
+        void write(Iterator first, Iterator last)
+        {
+            for (; first != last; ++first)
+                write(*first);
+        }
+
+        npy_intp size() const
+        {
+            return count;
+        }
+
+        void close()
+        {
+            if (columns && count % columns)
+                throw ValueError("number of elements is not a multiple of "
+                                 "the number of columns");
+            std::string h = header();
+            count = -1;
+            file.write_at(0, h.data(), h.size());
+            file.close();
+        }
+
+    private:
+        // Enough space for any shape with up to two dimensions
+        static const size_t header_size = 128;
+
+        std::string header() const
+        {
+            npy_intp dims[2] = {count, columns};
+            if (columns)
+                dims[0] = count / columns;
+            return npy_header(descr, columns ? 2 : 1, dims, header_size);
+        }
+
+        bool closed() const
+        {
+            return count == -1;
+        }
+
+        OutputFile file;
+        std::string descr;
+        npy_intp columns;
+        npy_intp count;
+    };
+
+    // Save an array in .npy format.
+    inline void save_npy(const char *filename, Array array)
+    {
+        if (!(array.flags() & NPY_ARRAY_C_CONTIGUOUS))
+            array = Array(PyArray_NewCopy((PyArrayObject *)(PyObject *)array,
+                                          NPY_CORDER));
+        std::string header = npy_header(npy_descr(array.descr()),
+                                        array.ndim(), array.dims());
+        OutputFile file(filename);
+        file.write(header.data(), header.size());
+        file.write(array.data<char>(), array.size() * array.itemsize());
+        file.close();
+    }
+    template <typename Iterator>
+    inline void save_npy(const char *filename, Iterator first, Iterator last)
+    {
+        NpyWriter<typename std::iterator_traits<Iterator>::value_type>
+            file(filename);
+        file.write(first, last);
+        file.close();
+    }
+    template <typename T>
+    inline void save_npy(const char *filename, const std::vector<T> &v)
+    {
+        NpyWriter<T> file(filename);
+        file.write(v.data(), v.size());
+        file.close();
+    }
+}
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef CAPY_PARALLEL_HH
+#define CAPY_PARALLEL_HH
+
+#include "capy.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <system_error>
+#include <thread>
+
+// This header contains the helpers Capy uses to split work across
+// several threads.
+
+namespace Capy
+{
+    inline unsigned &num_threads_setting()
+    {
+        static unsigned n = 0;
+        return n;
+    }
+
+    // Number of threads used by parallel algorithms.  Defaults to the
+    // number of cores.
+    inline unsigned num_threads()
+    {
+        unsigned n = num_threads_setting();
+        if (!n)
+            n = std::thread::hardware_concurrency();
+        return n ? n : 1;
+    }
+    inline void set_num_threads(unsigned n)
+    {
+        num_threads_setting() = n;
+    }
+
+    // Call body(i) for all i in [0, n), using up to num_threads()
+    // threads.  The GIL is released in the meantime, so body must not
+    // use the Python API.  The first exception thrown by body is
+    // rethrown in the calling thread.
+    template <typename Body>
+    void parallel_for(size_t n, Body body)
+    {
+        std::atomic<size_t> next(0);
+        std::exception_ptr error;
+        std::mutex error_mutex;
+        auto work = [&]() {
+            for (size_t i; (i = next++) < n; ) {
+                try {
+                    body(i);
+                }
+                catch (...) {
+                    std::lock_guard<std::mutex> lock(error_mutex);
+                    if (!error)
+                        error = std::current_exception();
+                    next = n;
+                }
+            }
+        };
+        {
+            AllowThreads allow;
+            std::vector<std::thread> threads;
+            size_t count = std::min<size_t>(num_threads(), n);
+            try {
+                for (size_t i = 1; i < count; ++i)
+                    threads.push_back(std::thread(work));
+            }
+            catch (std::system_error &) {
+                // Carry on with the threads we got.
+            }
+            work();
+            for (size_t i = 0; i < threads.size(); ++i)
+                threads[i].join();
+        }
+        if (error)
+            std::rethrow_exception(error);
+    }
+}
+
+#endif
@@ -0,0 +1,216 @@
+#ifndef CAPY_REFCOUNT_HH
+#define CAPY_REFCOUNT_HH
+
+// This header contains the reference counting diagnostics enabled by
+// defining CAPY_REFCOUNT_DIAGNOSTICS.  In this mode, every Object
+// remembers the source location it was created at, and the wrappers
+// created as well as the increfs and decrefs done through Object are
+// counted per source location and per wrapped function or method.
+// Objects created inside Capy's own helpers are attributed to the
+// helper.  The module function _capy_refcount_stats() returns the
+// counts.  Without the macro, nothing of this is compiled in.
+//
+// Objects may be released by threads without the GIL, so the counts
+// are guarded by a mutex, and the wrapped function counts are
+// attributed to is tracked per thread.
+
+#ifdef CAPY_REFCOUNT_DIAGNOSTICS
+
+#include <mutex>
+
+#define CAPY_SITE_ARGS const char *site_file_ = __builtin_FILE(), \
+        int site_line_ = __builtin_LINE()
+#define CAPY_SITE , CAPY_SITE_ARGS
+#define CAPY_SITE_INIT , site(Capy::refcount_site(site_file_, site_line_))
+#define CAPY_COUNT(counter) \
+    Capy::refcount_count(site, &Capy::RefcountStats::counter)
+#define CAPY_COUNT_AT(counter) \
+    Capy::refcount_count(Capy::refcount_site(site_file_, site_line_), \
+                         &Capy::RefcountStats::counter)
+
+namespace Capy
+{
+    struct RefcountStats
+    {
+        unsigned long objects;
+        unsigned long increfs;
+        unsigned long decrefs;
+    };
+
+    struct RefcountSiteHash
+    {
+        size_t operator()(const std::pair<const char *, int> &site) const
+        {
+            return std::hash<const char *>()(site.first) ^ site.second;
+        }
+    };
+    typedef std::unordered_map<std::pair<const char *, int>, RefcountStats,
+                               RefcountSiteHash> RefcountSites;
+
+    inline std::mutex &refcount_mutex()
+    {
+        static std::mutex *mutex = new std::mutex;
+        return *mutex;
+    }
+
+    inline RefcountSites &refcount_sites()
+    {
+        static RefcountSites *sites = new RefcountSites;
+        return *sites;
+    }
+    inline RefcountStats *refcount_site(const char *file, int line)
+    {
+        std::lock_guard<std::mutex> lock(refcount_mutex());
+        return &refcount_sites()[std::make_pair(file, line)];
+    }
+
+    // Counts per wrapped function, keyed by the PyCFunction in the
+    // method table
+    inline std::unordered_map<void *, RefcountStats> &refcount_methods()
+    {
+        static std::unordered_map<void *, RefcountStats> *methods =
+            new std::unordered_map<void *, RefcountStats>;
+        return *methods;
+    }
+    inline std::unordered_map<void *, std::string> &refcount_method_names()
+    {
+        static std::unordered_map<void *, std::string> *names =
+            new std::unordered_map<void *, std::string>;
+        return *names;
+    }
+    inline RefcountStats *&refcount_current_method()
+    {
+        static thread_local RefcountStats *current = 0;
+        return current;
+    }
+
+    inline void refcount_count(RefcountStats *site,
+                               unsigned long RefcountStats::*counter)
+    {
+        std::lock_guard<std::mutex> lock(refcount_mutex());
+        ++(site->*counter);
+        if (RefcountStats *method = refcount_current_method())
+            ++(method->*counter);
+    }
+
+    // Attributes the counts to the given wrapped function while alive
+    class RefcountScope
+    {
+    public:
+        explicit RefcountScope(void *method)
+            : saved(refcount_current_method())
+        {
+            std::lock_guard<std::mutex> lock(refcount_mutex());
+            refcount_current_method() = &refcount_methods()[method];
+        }
+        ~RefcountScope()
+        {
+            refcount_current_method() = saved;
+        }
+    private:
+        RefcountStats *saved;
+    };
+
+    // Record the names of the functions in a finished method table.
+    inline void refcount_register_methods(PyMethodDef *table,
+                                          const char *prefix)
+    {
+        for (; table && table->ml_name; ++table) {
+            std::string name = prefix ? prefix : "";
+            if (prefix)
+                name += ".";
+            refcount_method_names()[(void *)table->ml_meth] =
+                name + table->ml_name;
+        }
+    }
+
+    inline PyObject *refcount_stats_tuple(const RefcountStats &stats)
+    {
+        return Py_BuildValue("(kkk)", stats.objects, stats.increfs,
+                             stats.decrefs);
+    }
+
+    // Set key in dict to the element-wise sum of stats and the tuple
+    // already stored there, if any.
+    inline bool refcount_add_stats(PyObject *dict, const char *key,
+                                   RefcountStats stats)
+    {
+        PyObject *old = PyDict_GetItemString(dict, key);
+        if (old) {
+            stats.objects += PyLong_AsUnsignedLong(PyTuple_GET_ITEM(old, 0));
+            stats.increfs += PyLong_AsUnsignedLong(PyTuple_GET_ITEM(old, 1));
+            stats.decrefs += PyLong_AsUnsignedLong(PyTuple_GET_ITEM(old, 2));
+        }
+        PyObject *value = refcount_stats_tuple(stats);
+        if (!value)
+            return false;
+        int result = PyDict_SetItemString(dict, key, value);
+        Py_DECREF(value);
+        return result == 0;
+    }
+
+    // _capy_refcount_stats(reset=False) returns a dictionary with the
+    // keys "sites", mapping "file:line" to (objects, increfs, decrefs),
+    // and "methods", mapping names of wrapped functions to the same.
+    // The dictionaries are built with the plain Python API, so they
+    // don't show up in the counts.
+    inline PyObject *refcount_stats_function(PyObject *, PyObject *args)
+    {
+        int reset = 0;
+        if (!PyArg_ParseTuple(args, "|i", &reset))
+            return 0;
+        // Take a snapshot, so the lock isn't held while calling into
+        // Python.
+        RefcountSites site_stats;
+        std::unordered_map<void *, RefcountStats> method_stats;
+        {
+            std::lock_guard<std::mutex> lock(refcount_mutex());
+            site_stats = refcount_sites();
+            method_stats = refcount_methods();
+            if (reset) {
+                for (RefcountSites::iterator it = refcount_sites().begin();
+                     it != refcount_sites().end(); ++it)
+                    it->second = RefcountStats();
+                for (std::unordered_map<void *, RefcountStats>::iterator it =
+                         refcount_methods().begin();
+                     it != refcount_methods().end(); ++it)
+                    it->second = RefcountStats();
+            }
+        }
+        PyObject *sites = PyDict_New();
+        PyObject *methods = PyDict_New();
+        bool ok = sites && methods;
+        for (RefcountSites::iterator it = site_stats.begin();
+             ok && it != site_stats.end(); ++it) {
+            std::string key = it->first.first;
+            key += ":" + std::to_string(it->first.second);
+            ok = refcount_add_stats(sites, key.c_str(), it->second);
+        }
+        for (std::unordered_map<void *, RefcountStats>::iterator it =
+                 method_stats.begin(); ok && it != method_stats.end(); ++it) {
+            const std::string &name = refcount_method_names()[it->first];
+            ok = refcount_add_stats(
+                methods, name.empty() ? "<unknown>" : name.c_str(),
+                it->second);
+        }
+        PyObject *result = 0;
+        if (ok)
+            result = Py_BuildValue("{sOsO}", "sites", sites,
+                                   "methods", methods);
+        Py_XDECREF(sites);
+        Py_XDECREF(methods);
+        return result;
+    }
+}
+
+#else
+
+#define CAPY_SITE_ARGS
+#define CAPY_SITE
+#define CAPY_SITE_INIT
+#define CAPY_COUNT(counter)
+#define CAPY_COUNT_AT(counter)
+
+#endif
+
+#endif
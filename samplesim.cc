@@ -1,9 +1,22 @@
 #include "capy.hh"
+#include "algorithm.hh"
 #include "array.hh"
+#include "callback.hh"
+#include "chunked.hh"
+#include "format.hh"
+#include "generator.hh"
+#include "output.hh"
+#include "ufunc.hh"
 
-#include <fstream>
-#include <iostream>
-#include <iomanip>
+#include <math.h>
+
+// A grid point with its value, shared with NumPy as a record
+struct Point
+{
+    double x;
+    double y;
+    long step;
+};
 
 class MySimulation
 {
@@ -20,48 +33,347 @@ public:
         double x0 = config.setdefault("x0", 0.0);
         double x1 = config.setdefault("x1", 1.0);
         x.clear();
-        y.clear();
         for (double t = x0; t < x1 + time_step*1e-10; t += time_step)
-        {
             x.push_back(t);
-            y.push_back(f(t));
-        }
-        config.set("x", Capy::Array(&x[0], x.size()));
-        config.set("y", Capy::Array(&y[0], y.size()));
+        y.resize(x.size());
+        f.evaluate(x.data(), y.data(), x.size());
+        elapsed.modify() += time_step;
+        update_config();
     }
 
     void write_output(const char *filename)
     {
-        const char *name;
         bool verbose = config.setdefault("verbose", false);
+        Capy::TextFormat format;
         if (verbose)
-            name = config.get("name");
-        std::ofstream file(filename);
-        for (unsigned i = 0; i < y.size(); ++i)
-            if (verbose)
-                file << name << "(" << std::setw(12) << x[i] << ") = "
-                     << std::setw(12) << y[i] << "\n";
-            else
-                file << std::setw(12) << y[i] << "\n";
+            format.literal(config.get("name"))
+                .literal("(").column(12).literal(") = ");
+        format.column(12).literal("\n");
+        const double *columns[] = {x.data(), y.data()};
+        Capy::write_text(filename, format,
+                         verbose ? columns : columns + 1, y.size());
+    }
+
+    void save(const char *filename)
+    {
+        Capy::NpyWriter<double> file(
+            filename, 2, config.get("background_output", false));
+        for (unsigned i = 0; i < y.size(); ++i) {
+            file.write(x[i]);
+            file.write(y[i]);
+        }
+        file.close();
+    }
+
+    double y_sum()
+    {
+        return Capy::reduce(Capy::Array(y.data(), npy_intp(y.size())), 0.0,
+                            [](double a, double b) { return a + b; });
+    }
+
+    // Map the grid to [0, 1] and divide y by its largest magnitude.
+    void normalize()
+    {
+        if (x.size() < 2)
+            return;
+        Capy::Array xs(x.data(), npy_intp(x.size()));
+        Capy::Array ys(y.data(), npy_intp(y.size()));
+        double scale = Capy::transform_reduce<double, double>(
+            ys, 0.0, [](double a, double b) { return std::max(a, b); },
+            [](double v) { return fabs(v); });
+        if (scale == 0.0)
+            scale = 1.0;
+        double x0 = x.front(), width = x.back() - x.front();
+        Capy::for_each<double, double>(
+            xs, ys, [=](double &xi, double &yi) {
+                xi = (xi - x0) / width;
+                yi /= scale;
+            });
+    }
+
+    // Replace the points by a copy of the given records.
+    void set_points(Capy::RecordArray<Point> records)
+    {
+        points.assign(records.data(), records.data() + records.size());
+    }
+
+    // Largest difference of y from that of other on the common part of
+    // the grids
+    double difference(const MySimulation &other)
+    {
+        double result = 0.0;
+        for (size_t i = 0; i < std::min(y.size(), other.y.size()); ++i)
+            result = std::max(result, fabs(y[i] - other.y[i]));
+        return result;
+    }
+
+    // "ready" once a time step has been done, "empty" before
+    Capy::Interned status()
+    {
+        return x.empty() ? "empty" : "ready";
+    }
+
+    // Copy of y in an array aligned for SIMD loads
+    Capy::Array y_aligned()
+    {
+        Capy::Array result = Capy::Array::aligned<double>(y.size());
+        std::copy(y.begin(), y.end(), result.data<double>());
+        return result;
+    }
+
+    // Value of f at a single point
+    double value_at(double x)
+    {
+        return f(x);
+    }
+
+    // Iterate over y in arrays of the given size, keeping the
+    // simulation alive meanwhile.
+    Capy::Object y_chunks(long size)
+    {
+        return Capy::chunked(
+            y, size, Capy::Object(Capy::Class<MySimulation>::wrap(this)));
+    }
+
+#ifdef __cpp_impl_coroutine
+    // Run time steps until the caller stops asking, yielding the last
+    // value of y after each.
+    Capy::Generator<double> steps(double time_step)
+    {
+        for (;;) {
+            do_time_step(time_step);
+            co_yield y.back();
+        }
+    }
+#endif
+
+    size_t memory_usage() const
+    {
+        return (x.capacity() + y.capacity()) * sizeof(double) +
+            points.capacity() * sizeof(Point);
     }
 
+    void save_state(Capy::StateWriter &state)
+    {
+        state.write(x);
+        state.write(y);
+        state.write(points);
+        state.write(elapsed.get());
+    }
+
+    void load_state(Capy::StateReader &state)
+    {
+        state.read(x);
+        state.read(y);
+        state.read(points);
+        double time;
+        state.read(time);
+        elapsed = time;
+        update_config();
+    }
+
+    Capy::SharedVector<double> x;
+    Capy::SharedVector<double> y;
+    Capy::SharedVector<Point> points;
+    // Sum of the time steps done
+    Capy::Cached<double> elapsed;
+
 private:
-    Capy::Object f;
-    std::vector<double> x;
-    std::vector<double> y;
+    // Publish x and y in the configuration as views sharing their storage
+    void update_config()
+    {
+        config.set("x", Capy::Object(Capy::vector_view(x)));
+        config.set("y", Capy::Object(Capy::vector_view(y)));
+    }
+
+    Capy::Callback<double(double)> f;
 };
 
+CAPY_WRAPPED(MySimulation)
+
+double gaussian(double x)
+{
+    return exp(-0.5 * x * x);
+}
+
+// Running mean of the added values.  Its methods are registered with a
+// static table only.
+class Accumulator
+{
+public:
+    Accumulator(const Capy::Mapping &)
+        : count(0), sum(0.0)
+    {}
+
+    void add(double value)
+    {
+        ++count;
+        sum += value;
+    }
+
+    // Add the items of any iterable.
+    void add_all(Capy::Object values)
+    {
+        for (PyObject *value : values)
+            add(Capy::check_error(PyFloat_AsDouble(value)));
+    }
+
+    void add_list(Capy::List values)
+    {
+        for (PyObject *value : values)
+            add(Capy::check_error(PyFloat_AsDouble(value)));
+    }
+
+    // Add each key of counts as often as its value says.
+    void add_counts(Capy::Dict counts)
+    {
+        for (std::pair<PyObject *, PyObject *> item : counts) {
+            double value = Capy::check_error(PyFloat_AsDouble(item.first));
+            long n = Capy::check_error(PyInt_AsLong(item.second));
+            count += n;
+            sum += n * value;
+        }
+    }
+
+    double mean()
+    {
+        return count ? sum / count : 0.0;
+    }
+
+    long size()
+    {
+        return count;
+    }
+
+private:
+    long count;
+    double sum;
+};
+
+CAPY_WRAPPED(Accumulator)
+
+// Mean of values, weighted by the weights given for some of the
+// indices, 1 for the rest
+double weighted_mean(Capy::TypedList<double> values,
+                     Capy::TypedDict<long, double> weights)
+{
+    std::vector<double> w(values.size(), 1.0);
+    for (auto &item : weights)
+        if (item.first >= 0 && item.first < (long)w.size())
+            w[item.first] = item.second;
+    double sum = 0.0, total = 0.0;
+    for (size_t i = 0; i < values.size(); ++i) {
+        sum += w[i] * values[i];
+        total += w[i];
+    }
+    return sum / total;
+}
+
+double trace(Capy::TypedArray<double, 2, false> matrix)
+{
+    double sum = 0.0;
+    for (npy_intp i = 0; i < std::min(matrix.shape(0), matrix.shape(1)); ++i)
+        sum += matrix(i, i);
+    return sum;
+}
+
 PyMODINIT_FUNC
 initsamplesim()
 {
     import_array();
+    import_umath();
     Capy::Extension extension(
         "samplesim", "An example of a simulation wrapped with Capy");
+    extension.add_ufunc<double, double, &gaussian>(
+        "gaussian", "Unnormalized Gaussian exp(-x**2 / 2).");
+    static PyMethodDef functions[] = {
+        Capy::Extension::function_def<
+            double, Capy::TypedList<double>, Capy::TypedDict<long, double>,
+            &weighted_mean>(
+                "weighted_mean", "weighted_mean(values, weights): mean of a "
+                "list of floats, weighted by a dictionary mapping indices to "
+                "weights."),
+        Capy::Extension::function_def<
+            double, Capy::TypedArray<double, 2, false>, &trace>(
+                "trace", "Sum of the diagonal of a two-dimensional float "
+                "array."),
+        {0}
+    };
+    extension.add_functions(functions);
+    Capy::Record<Point>()
+        .add_field("x", &Point::x)
+        .add_field("y", &Point::y)
+        .add_field("step", &Point::step);
     Capy::Class<MySimulation> mysim(
         extension, "MySimulation", "A stupid simulation examples class");
+    static PyMethodDef simulation_methods[] = {
+        Capy::Class<MySimulation>::method_def<double, &MySimulation::y_sum>(
+            "y_sum", "Sum of y, computed in parallel."),
+        Capy::Class<MySimulation>::method_def<&MySimulation::normalize>(
+            "normalize", "Map x to [0, 1] and scale y to a largest "
+            "magnitude of 1."),
+        {0}
+    };
+    mysim.add_methods(simulation_methods);
     mysim.add_method<double, &MySimulation::do_time_step>(
         "do_time_step", "Run a single time step of the simulation.");
+    mysim.add_run_loop<double, &MySimulation::do_time_step>(
+        "run", "run(steps, time_step, observer=None, every=0): run several "
+        "time steps, calling observer(sim, steps_done) every few steps.");
     mysim.add_method<const char *, &MySimulation::write_output>(
         "write_output", "Write output to the given file name.");
+    mysim.add_method<const char *, &MySimulation::save>(
+        "save", "Save x and y as an (n, 2) array in .npy format.");
+    mysim.add_method<Capy::Interned, &MySimulation::status>(
+        "status", "\"ready\" once a time step has been done, \"empty\" "
+        "before.");
+    mysim.add_method<Capy::Array, &MySimulation::y_aligned>(
+        "y_aligned", "Copy of y in an array aligned to 64 bytes.");
+    mysim.add_method<double, double, &MySimulation::value_at>(
+        "value_at", "Evaluate f at a single point.", Capy::Memoize(64));
+    mysim.add_method<Capy::RecordArray<Point>, &MySimulation::set_points>(
+        "set_points", "Set the points from an array of records with the "
+        "fields x, y and step.");
+    mysim.add_method<double, const MySimulation &,
+                     &MySimulation::difference>(
+        "difference", "Largest difference of y from that of another "
+        "simulation.");
+    mysim.add_method<Capy::Object, long, &MySimulation::y_chunks>(
+        "y_chunks", "Iterate over y in arrays of the given size.");
+#ifdef __cpp_impl_coroutine
+    mysim.add_method<Capy::Generator<double>, double, &MySimulation::steps>(
+        "steps", "Iterate over time steps, yielding the last value of y.");
+#endif
+    mysim.add_pickle<&MySimulation::save_state, &MySimulation::load_state,
+                     &MySimulation::config>();
     mysim.add_py_member("config", &MySimulation::config);
+    mysim.set_sizeof<&MySimulation::memory_usage>();
+    mysim.add_member("elapsed", &MySimulation::elapsed,
+                     "Sum of the time steps done.");
+    mysim.add_array_member("x", &MySimulation::x, "Grid of the last time step.");
+    mysim.add_array_member("y", &MySimulation::y, "Values of f on the grid.");
+    mysim.add_array_member("points", &MySimulation::points,
+                           "Points set by set_points().");
+    Capy::Class<Accumulator> accumulator(
+        extension, "Accumulator", "Running mean of numbers");
+    static PyMethodDef accumulator_methods[] = {
+        Capy::Class<Accumulator>::method_def<double, &Accumulator::add>(
+            "add", "Add a value."),
+        Capy::Class<Accumulator>::method_def<Capy::Object,
+                                             &Accumulator::add_all>(
+            "add_all", "Add the items of an iterable."),
+        Capy::Class<Accumulator>::method_def<Capy::List,
+                                             &Accumulator::add_list>(
+            "add_list", "Add the items of a list."),
+        Capy::Class<Accumulator>::method_def<Capy::Dict,
+                                             &Accumulator::add_counts>(
+            "add_counts", "Add each key of a dictionary as often as its "
+            "value says."),
+        Capy::Class<Accumulator>::method_def<double, &Accumulator::mean>(
+            "mean", "Mean of the values added so far."),
+        Capy::Class<Accumulator>::method_def<long, &Accumulator::size>(
+            "size", "Number of values added so far."),
+        {0}
+    };
+    accumulator.add_methods(accumulator_methods);
 }
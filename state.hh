@@ -0,0 +1,145 @@
+#ifndef CAPY_STATE_HH
+#define CAPY_STATE_HH
+
+#include <string.h>
+#include <string>
+#include <type_traits>
+
+// This header contains the binary serialization used to pickle
+// instances of wrapped classes.  The data is stored in the machine's
+// native representation, so it can only be loaded on the same
+// architecture.
+
+namespace Capy
+{
+    // Collects binary state data directly in a Python string object.
+    class StateWriter
+    {
+    public:
+        StateWriter()
+            : blob(check_error(PyString_FromStringAndSize(0, 4096))),
+              size(0)
+        {}
+        ~StateWriter()
+        {
+            Py_XDECREF(blob);
+        }
+        void write(const void *data, size_t n)
+        {
+            reserve(n);
+            memcpy(PyString_AS_STRING(blob) + size, data, n);
+            size += n;
+        }
+        // Trivially copyable values are stored as raw bytes.
+        template <typename T>
+        void write(const T &value)
+        {
+            static_assert(std::is_trivially_copyable<T>::value,
+                          "only trivially copyable types can be written");
+            write(&value, sizeof(T));
+        }
+        template <typename T, typename A>
+        void write(const std::vector<T, A> &v)
+        {
+            static_assert(std::is_trivially_copyable<T>::value,
+                          "only trivially copyable types can be written");
+            write(v.size());
+            write(v.data(), v.size() * sizeof(T));
+        }
+        void write(const std::string &s)
+        {
+            write(s.size());
+            write(s.data(), s.size());
+        }
+        // The collected data as a Python string.
+        Object result()
+        {
+            if (_PyString_Resize(&blob, size) == -1)
+                throw ExceptionInPythonAPI();
+            return Object(blob).new_reference();
+        }
+    private:
+        StateWriter(const StateWriter &);
+        StateWriter &operator=(const StateWriter &);
+
+        void reserve(size_t n)
+        {
+            size_t capacity = PyString_GET_SIZE(blob);
+            if (size + n <= capacity)
+                return;
+            while (capacity < size + n)
+                capacity *= 2;
+            if (_PyString_Resize(&blob, capacity) == -1)
+                throw ExceptionInPythonAPI();
+        }
+
+        PyObject *blob;
+        size_t size;
+    };
+
+    // Reads binary state data from any object supporting the buffer
+    // interface.
+    class StateReader
+    {
+    public:
+        explicit StateReader(Object blob_)
+            : blob(blob_)
+        {
+            const void *buffer;
+            Py_ssize_t length;
+            check_error(PyObject_AsReadBuffer(blob, &buffer, &length));
+            pos = (const char *)buffer;
+            end = pos + length;
+        }
+        void read(void *data, size_t n)
+        {
+            if (n > size_t(end - pos))
+                throw ValueError("truncated state data");
+            memcpy(data, pos, n);
+            pos += n;
+        }
+        template <typename T>
+        void read(T &value)
+        {
+            static_assert(std::is_trivially_copyable<T>::value,
+                          "only trivially copyable types can be read");
+            read(&value, sizeof(T));
+        }
+        template <typename T, typename A>
+        void read(std::vector<T, A> &v)
+        {
+            static_assert(std::is_trivially_copyable<T>::value,
+                          "only trivially copyable types can be read");
+            size_t n = read<size_t>();
+            if (n > size_t(end - pos) / sizeof(T))
+                throw ValueError("truncated state data");
+            v.resize(n);
+            read(v.data(), n * sizeof(T));
+        }
+        void read(std::string &s)
+        {
+            size_t n = read<size_t>();
+            if (n > size_t(end - pos))
+                throw ValueError("truncated state data");
+            s.assign(pos, n);
+            pos += n;
+        }
+        template <typename T>
+        T read()
+        {
+            T value;
+            read(value);
+            return value;
+        }
+        bool at_end() const
+        {
+            return pos == end;
+        }
+    private:
+        Object blob;
+        const char *pos;
+        const char *end;
+    };
+}
+
+#endif
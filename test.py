@@ -1,7 +1,18 @@
 #!/usr/bin/env python2.7
 
+import ctypes
+import itertools
+import math
+import numpy
+import pickle
 import samplesim
 
+def error(f, *args):
+    try:
+        f(*args)
+    except (TypeError, ValueError), e:
+        return e
+
 class Config:
     def f(x):
         return x*x
@@ -11,7 +22,114 @@ class Config:
     x1 = 1.0
 
 sim = samplesim.MySimulation(vars(Config))
+print sim.status() is intern("empty")
 sim.do_time_step(0.1)
+print sim.run(5, 0.1, observer=lambda s, n: n >= 3, every=1)
 sim.write_output("test1.out")
+print sim.status() is intern("ready"), sim.status() is sim.status()
+elapsed = sim.elapsed
+print elapsed is sim.elapsed
+sim.do_time_step(0.1)
+print sim.elapsed is elapsed, sim.elapsed - elapsed
+sim.elapsed = 0.0
+print sim.elapsed
+print sim.x[:3], sim.y[:3]
+print (sim.config["x"] == sim.x).all(), (sim.config["y"] == sim.y).all()
+x = sim.x
+sim.do_time_step(0.05)
+print len(x), len(sim.x), x[:3], sim.x[:3]
+sim.do_time_step(0.1)
+print sim.value_at(2.0), sim.value_at(2.0), sim.value_at(3.0)
+print samplesim._capy_memo_stats()["samplesim.MySimulation.value_at"][:2]
+print sim.value_at_batch([1.0, 2.0, 3.0])
+print [type(it).__name__ for it in sim.y_chunks_batch([2, 3])]
+print error(sim.value_at_batch, [1.0, "a", 2.0])
+points = numpy.zeros(3, dtype=[("x", float), ("y", float), ("step", int)])
+points["x"] = [0.0, 0.5, 1.0]
+points["step"] = 7
+sim.set_points(points)
+print sim.points.dtype, sim.points.dtype.fields["step"][1]
+print sim.points["x"], sim.points["step"]
+print error(sim.set_points, numpy.zeros(3, dtype=[("y", float), ("x", float),
+                                                  ("step", int)]))
+padded = numpy.dtype({"names": ["x", "y", "step"],
+                      "formats": [float, float, int],
+                      "offsets": [0, 8, 24], "itemsize": 32})
+print error(sim.set_points, numpy.zeros(3, dtype=padded))
+print error(sim.set_points, numpy.zeros(3))
+def aligned_blocks():
+    return samplesim._capy_memory_summary().get("capy.aligned", (0, 0))
+before = aligned_blocks()
+a = sim.y_aligned()
+print a.ctypes.data % 64 == 0, (a == sim.y).all()
+print aligned_blocks()[0] - before[0], aligned_blocks()[1] - before[1] >= a.nbytes
+del a
+print aligned_blocks() == before
+print sum(chunk.sum() for chunk in sim.y_chunks(4))
+print len(set(chunk.ctypes.data for chunk in sim.y_chunks(2)))
+print list(itertools.islice(sim.steps(0.1), 3))
 Config.verbose = False
 sim.write_output("test2.out")
+sim.save("test.npy")
+def sqr(x):
+    return x*x
+class PicklableConfig:
+    f = sqr
+    name = "sqr"
+    verbose = False
+    x0 = 0.0
+    x1 = 1.0
+sim2 = samplesim.MySimulation(vars(PicklableConfig))
+sim2.do_time_step(0.1)
+sim2 = pickle.loads(pickle.dumps(sim2, 2))
+sim2.write_output("test3.out")
+sim3 = samplesim.MySimulation(name="sqrt", x0=1.0, x1=4.0, f=math.sqrt)
+sim4 = pickle.loads(pickle.dumps(sim3, 2))
+sim4.do_time_step(0.5)
+print sim4.config["name"], sim4.x[0], sim4.x[-1], sim4.y[-1]
+print sim4.y_sum(), sum(sim4.y)
+sim4.normalize()
+print sim4.x[0], sim4.x[-1], abs(sim4.y).max()
+acc = samplesim.Accumulator()
+acc.add(1.0)
+acc.add(2)
+print acc.mean(), acc.size()
+acc.add_all(x * 2.0 for x in range(3))
+acc.add_list([1.5, 2.5])
+acc.add_counts({4.0: 2, 0.5: 1})
+print acc.mean(), acc.size()
+print error(acc.add_list, (1.0,))
+print sorted(name for name in dir(samplesim) if name.startswith("_capy_"))
+square = ctypes.CFUNCTYPE(ctypes.c_double, ctypes.c_double)(lambda x: x*x)
+sim5 = samplesim.MySimulation(f=square)
+sim5.do_time_step(0.5)
+print sim5.y
+class SubSimulation(samplesim.MySimulation):
+    pass
+sub = SubSimulation(vars(Config))
+sub.do_time_step(0.1)
+print sim5.difference(sub), sub.difference(sub)
+print error(sim5.difference, 1.0)
+null = ctypes.CFUNCTYPE(ctypes.c_double, ctypes.c_double)()
+print error(lambda: samplesim.MySimulation(f=null))
+print samplesim.weighted_mean([1.0, 2, 3L], {1: 2.0, 2: 0})
+print error(samplesim.weighted_mean, [1.0, True], {})
+print error(samplesim.weighted_mean, (1.0,), {})
+print error(samplesim.weighted_mean, [1.0], {"a": 2.0})
+print error(samplesim.weighted_mean, [1.0], {0: "2"})
+print error(samplesim.weighted_mean, [1.0], {True: 2.0})
+print samplesim.trace(numpy.arange(9.0).reshape(3, 3).T)
+print error(samplesim.trace, numpy.arange(3.0))
+print error(samplesim.trace, numpy.eye(3, dtype=int))
+print samplesim.gaussian(numpy.linspace(-3.0, 3.0, 7))
+
+def memory():
+    return samplesim._capy_memory_summary()["samplesim.MySimulation"]
+before = memory()
+extra = samplesim.MySimulation()
+extra.do_time_step(0.001)
+during = memory()
+print during[0] - before[0], during[1] - before[1] == extra.__sizeof__()
+print extra.__sizeof__() >= 2 * len(extra.x) * extra.x.itemsize
+del extra
+print memory() == before
@@ -5,52 +5,107 @@
 
 namespace Capy
 {
+    // String constant to be returned from a wrapped function.  The
+    // Python string is created only once for each distinct pointer, so
+    // returning the same constant again doesn't allocate.
+    class Interned
+    {
+    public:
+        Interned(const char *value_)
+            : value(value_)
+        {}
+        const char *value;
+    };
+
+    inline PyObject *interned_string(const char *value)
+    {
+        static std::unordered_map<const char *, PyObject *> cache;
+        PyObject *&str = cache[value];
+        if (!str)
+            str = check_error(PyString_InternFromString(value));
+        return str;
+    }
+
     // Wrapper around Python objects, implicitly convertible from and
     // to basic C++ types
     class Object
     {
     public:
-        explicit Object(PyObject *self_)
-            : self(self_)
+        explicit Object(PyObject *self_ CAPY_SITE)
+            : self(self_) CAPY_SITE_INIT
         {
+            CAPY_COUNT(objects);
             check_error(self);
         }
-        Object(const Object &other)
-            : self(other.self)
+        Object(const Object &other CAPY_SITE)
+            : self(other.self) CAPY_SITE_INIT
         {
-            Py_INCREF(self);
+            CAPY_COUNT(objects);
+            CAPY_COUNT(increfs);
+            incref(self);
         }
         ~Object()
         {
-            Py_DECREF(self);
+            CAPY_COUNT(decrefs);
+            decref(self);
         }
-        Object(bool value)
-            : self(PyBool_FromLong(value))
-        {}
-        Object(long value)
-            : self(PyInt_FromLong(value))
+        Object(bool value CAPY_SITE)
+            : self(PyBool_FromLong(value)) CAPY_SITE_INIT
+        {
+            CAPY_COUNT(objects);
+        }
+        Object(long value CAPY_SITE)
+            : self(PyInt_FromLong(value)) CAPY_SITE_INIT
+        {
+            CAPY_COUNT(objects);
+            check_error(self);
+        }
+        Object(int value CAPY_SITE)
+            : self(PyInt_FromLong(value)) CAPY_SITE_INIT
+        {
+            CAPY_COUNT(objects);
+            check_error(self);
+        }
+        Object(double value CAPY_SITE)
+            : self(PyFloat_FromDouble(value)) CAPY_SITE_INIT
         {
+            CAPY_COUNT(objects);
             check_error(self);
         }
-        Object(int value)
-            : self(PyInt_FromLong(value))
+        Object(const char *value CAPY_SITE)
+            : self(PyString_FromString(value)) CAPY_SITE_INIT
         {
+            CAPY_COUNT(objects);
             check_error(self);
         }
-        Object(double value)
-            : self(PyFloat_FromDouble(value))
+        Object(const std::string &value CAPY_SITE)
+            : self(PyString_FromStringAndSize(value.data(), value.size()))
+              CAPY_SITE_INIT
         {
+            CAPY_COUNT(objects);
             check_error(self);
         }
-        Object(const char *value)
-            : self(PyString_FromString(value))
+        Object(std::string_view value CAPY_SITE)
+            : self(PyString_FromStringAndSize(value.data(), value.size()))
+              CAPY_SITE_INIT
         {
+            CAPY_COUNT(objects);
             check_error(self);
         }
+        Object(const Interned &value CAPY_SITE)
+            : self(interned_string(value.value)) CAPY_SITE_INIT
+        {
+            CAPY_COUNT(objects);
+            CAPY_COUNT(increfs);
+            Py_INCREF(self);
+        }
+        // Assignment is counted at the site of the assigned-to object.
         Object &operator=(const Object &other)
         {
-            Py_INCREF(other.self);
-            Py_DECREF(self);
+            CAPY_COUNT(increfs);
+            CAPY_COUNT(decrefs);
+            incref(other.self);
+            decref(self);
             self = other.self;
             return *this;
         }
@@ -74,12 +129,26 @@ namespace Capy
         {
             return check_error(PyString_AsString(self));
         }
+        // The view refers to the string's buffer and is only valid as
+        // long as the string object is alive.
+        operator std::string_view() const
+        {
+            char *data;
+            Py_ssize_t size;
+            check_error(PyString_AsStringAndSize(self, &data, &size));
+            return std::string_view(data, size);
+        }
+        operator std::string() const
+        {
+            return std::string(std::string_view(*this));
+        }
         operator PyObject *() const
         {
             return self;
         }
-        Object &new_reference()
+        Object &new_reference(CAPY_SITE_ARGS)
         {
+            CAPY_COUNT_AT(increfs);
             Py_INCREF(self);
             return *this;
         }
@@ -113,10 +182,76 @@ namespace Capy
                                                        (PyObject *)arg3,
                                                        (PyObject *)arg4, 0));
         }
+        class iterator;
+        iterator begin() const;
+        iterator end() const;
     protected:
         PyObject *self;
+#ifdef CAPY_REFCOUNT_DIAGNOSTICS
+        RefcountStats *site;
+#endif
     };
 
+    // Iterator using Python's iterator protocol.  Items are borrowed
+    // references, valid until the iterator moves on; wrap them in an
+    // Object to keep them.
+    class Object::iterator
+    {
+    public:
+        iterator()
+            : iter(0), item(0)
+        {}
+        explicit iterator(PyObject *iterable)
+            : iter(check_error(PyObject_GetIter(iterable))), item(0)
+        {
+            next();
+        }
+        iterator(const iterator &other)
+            : iter(other.iter), item(other.item)
+        {
+            Py_XINCREF(iter);
+            Py_XINCREF(item);
+        }
+        ~iterator()
+        {
+            Py_XDECREF(item);
+            Py_XDECREF(iter);
+        }
+        PyObject *operator*() const
+        {
+            return item;
+        }
+        iterator &operator++()
+        {
+            next();
+            return *this;
+        }
+        bool operator!=(const iterator &other) const
+        {
+            return item != other.item;
+        }
+    private:
+        iterator &operator=(const iterator &);
+        void next()
+        {
+            Py_XDECREF(item);
+            item = PyIter_Next(iter);
+            if (!item && PyErr_Occurred())
+                throw ExceptionInPythonAPI();
+        }
+        PyObject *iter;
+        PyObject *item;
+    };
+
+    inline Object::iterator Object::begin() const
+    {
+        return iterator(self);
+    }
+    inline Object::iterator Object::end() const
+    {
+        return iterator();
+    }
+
     class Sequence : public Object
     {
     public:
@@ -198,6 +333,43 @@ namespace Capy
         {
             check_error(PyList_Reverse(self));
         }
+
+        // Iterator with direct item access, yielding borrowed references
+        class iterator
+        {
+        public:
+            iterator(PyObject *list_, ssize_t index_)
+                : list(list_), index(index_)
+            {}
+            PyObject *operator*() const
+            {
+                return PyList_GET_ITEM(list, index);
+            }
+            iterator &operator++()
+            {
+                ++index;
+                return *this;
+            }
+            // The end iterator compares against the current size, so
+            // the list may change during iteration.
+            bool operator!=(const iterator &other) const
+            {
+                if (other.index == -1)
+                    return index < PyList_GET_SIZE(list);
+                return index != other.index;
+            }
+        private:
+            PyObject *list;
+            ssize_t index;
+        };
+        iterator begin() const
+        {
+            return iterator(self, 0);
+        }
+        iterator end() const
+        {
+            return iterator(self, -1);
+        }
     };
 
     class Mapping : public Object
@@ -324,6 +496,46 @@ namespace Capy
             PyObject_CallMethod(self, (char *)"update",(char *) "O",
                                 (PyObject *)other);
         }
+
+        // Iterator over (key, value) pairs of borrowed references using
+        // PyDict_Next.  The dict must not change size during iteration.
+        class iterator
+        {
+        public:
+            iterator(PyObject *dict_, Py_ssize_t pos_)
+                : dict(dict_), pos(pos_), key(0), value(0)
+            {
+                if (pos != -1)
+                    ++*this;
+            }
+            std::pair<PyObject *, PyObject *> operator*() const
+            {
+                return std::make_pair(key, value);
+            }
+            iterator &operator++()
+            {
+                if (!PyDict_Next(dict, &pos, &key, &value))
+                    pos = -1;
+                return *this;
+            }
+            bool operator!=(const iterator &other) const
+            {
+                return pos != other.pos;
+            }
+        private:
+            PyObject *dict;
+            Py_ssize_t pos;
+            PyObject *key;
+            PyObject *value;
+        };
+        iterator begin() const
+        {
+            return iterator(self, 0);
+        }
+        iterator end() const
+        {
+            return iterator(self, -1);
+        }
     };
 }
 
@@ -0,0 +1,115 @@
+#ifndef CAPY_UFUNC_HH
+#define CAPY_UFUNC_HH
+
+#include "array.hh"
+#include <numpy/ufuncobject.h>
+
+// This header contains the generation of NumPy ufuncs from scalar C++
+// functions, see Extension::add_ufunc().  Modules using it must call
+// import_umath() in their init function.
+
+namespace Capy
+{
+    // Exceptions can't propagate through the C loops of NumPy, so the
+    // loops turn them into a Python error, which NumPy reports when the
+    // loop returns.  Called in a catch block.
+    inline void ufunc_error()
+    {
+        NPY_ALLOW_C_API_DEF
+        NPY_ALLOW_C_API;
+        translate_exception();
+        NPY_DISABLE_C_API;
+    }
+
+    template <typename RT, typename T, RT (*func)(T)>
+    struct UnaryUFunc
+    {
+        // The dimension arguments are const in newer NumPy versions, so
+        // their type is deduced.
+        template <typename Dims>
+        static void loop(char **args, Dims dims, Dims steps, void *)
+        {
+            try {
+                npy_intp n = dims[0];
+                char *in = args[0];
+                char *out = args[1];
+                if (steps[0] == sizeof(T) && steps[1] == sizeof(RT)) {
+                    const T *x = (const T *)in;
+                    RT *y = (RT *)out;
+                    for (npy_intp i = 0; i < n; ++i)
+                        y[i] = func(x[i]);
+                    return;
+                }
+                for (npy_intp i = 0; i < n;
+                     ++i, in += steps[0], out += steps[1])
+                    *(RT *)out = func(*(const T *)in);
+            }
+            catch (...) {
+                ufunc_error();
+            }
+        }
+        static Object create(const char *name, const char *doc)
+        {
+            static PyUFuncGenericFunction funcs[] = {loop};
+            static void *data[] = {0};
+            static char types[] = {
+                char(NumpyTypeCode<T>::value), char(NumpyTypeCode<RT>::value)};
+            return Object(PyUFunc_FromFuncAndData(
+                              funcs, data, types, 1, 1, 1, PyUFunc_None,
+                              const_cast<char *>(name),
+                              const_cast<char *>(doc ? doc : ""), 0));
+        }
+    };
+
+    template <typename RT, typename T1, typename T2, RT (*func)(T1, T2)>
+    struct BinaryUFunc
+    {
+        template <typename Dims>
+        static void loop(char **args, Dims dims, Dims steps, void *)
+        {
+            try {
+                npy_intp n = dims[0];
+                char *in1 = args[0];
+                char *in2 = args[1];
+                char *out = args[2];
+                if (steps[0] == sizeof(T1) && steps[1] == sizeof(T2) &&
+                    steps[2] == sizeof(RT)) {
+                    const T1 *x1 = (const T1 *)in1;
+                    const T2 *x2 = (const T2 *)in2;
+                    RT *y = (RT *)out;
+                    for (npy_intp i = 0; i < n; ++i)
+                        y[i] = func(x1[i], x2[i]);
+                    return;
+                }
+                if (in1 == out && steps[0] == 0 && steps[2] == 0) {
+                    // Reduction: keep the accumulator in a register.
+                    RT acc = *(RT *)out;
+                    for (npy_intp i = 0; i < n; ++i, in2 += steps[1])
+                        acc = func(acc, *(const T2 *)in2);
+                    *(RT *)out = acc;
+                    return;
+                }
+                for (npy_intp i = 0; i < n; ++i, in1 += steps[0],
+                         in2 += steps[1], out += steps[2])
+                    *(RT *)out = func(*(const T1 *)in1, *(const T2 *)in2);
+            }
+            catch (...) {
+                ufunc_error();
+            }
+        }
+        static Object create(const char *name, const char *doc)
+        {
+            static PyUFuncGenericFunction funcs[] = {loop};
+            static void *data[] = {0};
+            static char types[] = {
+                char(NumpyTypeCode<T1>::value), char(NumpyTypeCode<T2>::value),
+                char(NumpyTypeCode<RT>::value)};
+            return Object(PyUFunc_FromFuncAndData(
+                              funcs, data, types, 1, 2, 1, PyUFunc_None,
+                              const_cast<char *>(name),
+                              const_cast<char *>(doc ? doc : ""), 0));
+        }
+    };
+}
+
+#endif